@@ -5,349 +5,6382 @@
 #include <cstdlib>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sched.h>
 #include <signal.h>
+#include <spawn.h>
 #include <fstream>
+#include <sstream>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <iomanip>
+#include <set>
+#include <cstdint>
+#include <unordered_map>
+#include <map>
+#include <deque>
+#include <tuple>
+#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <strings.h>
+#include <linux/io_uring.h>
+#include <linux/kvm.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
 
 namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
 
-class ComputerVM {
+static int remainingMs(Clock::time_point deadline) {
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+    return left > 0 ? static_cast<int>(left) : 0;
+}
+
+// signalfd de SIGINT/SIGTERM/SIGHUP mientras arranca la máquina (-1 fuera del
+// arranque). No se lee: la señal sigue pendiente y las esperas largas lo
+// vigilan para abandonar en cuanto llega
+static std::atomic<int> bootInterruptFd(-1);
+
+static bool bootInterrupted() {
+    pollfd pfd = {bootInterruptFd.load(), POLLIN, 0};
+    return pfd.fd >= 0 && poll(&pfd, 1, 0) == 1;
+}
+
+// poll() de un descriptor que vuelve como si expirara el plazo si llega una
+// señal de parada durante el arranque
+static int pollInterruptible(int fd, short events, int timeoutMs) {
+    pollfd pfds[2] = {{fd, events, 0}, {bootInterruptFd.load(), POLLIN, 0}};
+    int ready = poll(pfds, 2, timeoutMs);
+    if (ready > 0 && (pfds[1].revents & POLLIN)) return 0;
+    return ready;
+}
+
+static int openPidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// Proceso hijo lanzado con spawnProcess(), seguido a través de su pidfd
+struct ChildProcess {
+    pid_t pid;
+    int pidfd;
+    int status;
+
+    ChildProcess() : pid(-1), pidfd(-1), status(0) {}
+
+    bool running() const { return pid != -1; }
+
+    void sendSignal(int sig) {
+        if (pid == -1) return;
+#ifdef SYS_pidfd_send_signal
+        if (pidfd >= 0 && syscall(SYS_pidfd_send_signal, pidfd, sig, nullptr, 0) == 0) return;
+#endif
+        kill(pid, sig);
+    }
+
+    // Recoge el proceso si ya terminó; false si ya no está vivo
+    bool alive() {
+        if (pid == -1) return false;
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            release();
+            return false;
+        }
+        return true;
+    }
+
+    // Espera a que termine como mucho timeoutMs (-1 = sin límite)
+    bool waitExit(int timeoutMs) {
+        auto deadline = Clock::now() + std::chrono::milliseconds(timeoutMs < 0 ? 0 : timeoutMs);
+        while (alive()) {
+            int waitMs = timeoutMs < 0 ? -1 : remainingMs(deadline);
+            if (timeoutMs >= 0 && waitMs == 0) return false;
+            if (pidfd >= 0) {
+                pollfd pfd = {pidfd, POLLIN, 0};
+                poll(&pfd, 1, waitMs);
+            } else {
+                usleep(10000);
+            }
+        }
+        return true;
+    }
+
+    void release() {
+        if (pidfd >= 0) close(pidfd);
+        pid = -1;
+        pidfd = -1;
+    }
+};
+
+// PR_SET_PDEATHSIG salta cuando termina el hilo que creó al hijo, no el
+// proceso: los hijos se crean desde este hilo, que vive tanto como el lanzador
+// (las fases del arranque y los lanzamientos del pool usan hilos efímeros)
+static void runOnSpawnThread(const std::function<void()>& job) {
+    struct State {
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::deque<std::pair<const std::function<void()>*, bool*>> jobs;
+    };
+    static State* state = new State; // nunca se destruye: el hilo sigue esperando al salir
+    static std::once_flag started;
+    std::call_once(started, []() {
+        std::thread([]() {
+            std::unique_lock<std::mutex> lock(state->mutex);
+            while (true) {
+                state->wake.wait(lock, []() { return !state->jobs.empty(); });
+                auto next = state->jobs.front();
+                state->jobs.pop_front();
+                lock.unlock();
+                (*next.first)();
+                lock.lock();
+                *next.second = true;
+                state->wake.notify_all();
+            }
+        }).detach();
+    });
+
+    bool done = false;
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->jobs.push_back({&job, &done});
+    state->wake.notify_all();
+    state->wake.wait(lock, [&]() { return done; });
+}
+
+static std::string findExecutable(const std::string& name) {
+    const char* path = getenv("PATH");
+    std::stringstream dirs(path ? path : "/usr/local/bin:/usr/bin:/bin");
+    std::string dir;
+    while (std::getline(dirs, dir, ':')) {
+        std::string candidate = (dir.empty() ? "." : dir) + "/" + name;
+        if (access(candidate.c_str(), X_OK) == 0) return candidate;
+    }
+    return "";
+}
+
+// Lanza argv con posix_spawn (sin copiar tablas de páginas como fork): stdin
+// a /dev/null, stderr opcionalmente a un fichero, máscara de señales vacía y
+// disposiciones por defecto, en su propio grupo de procesos para que el
+// Ctrl-C de la terminal llegue sólo al lanzador. Pasa por el trampolín
+// --exec-child (ver execChild) para que el hijo reciba SIGTERM si el
+// lanzador muere, aunque sea con SIGKILL
+static bool spawnProcess(const std::vector<std::string>& argv, const std::string& stderrPath,
+                         ChildProcess& child, std::string& error) {
+    std::string program = argv[0].find('/') == std::string::npos ? findExecutable(argv[0]) : argv[0];
+    if (program.empty() || access(program.c_str(), X_OK) != 0) {
+        error = std::strerror(program.empty() ? ENOENT : errno);
+        return false;
+    }
+    std::string self = "/proc/self/exe";
+    std::string flag = "--exec-child";
+    std::string parent = std::to_string(getpid());
+    std::vector<char*> args = {&self[0], &flag[0], &parent[0], &program[0]};
+    for (size_t i = 1; i < argv.size(); i++) {
+        args.push_back(const_cast<char*>(argv[i].c_str()));
+    }
+    args.push_back(nullptr);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    if (!stderrPath.empty()) {
+        posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, stderrPath.c_str(),
+                                         O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    for (int sig : {SIGINT, SIGTERM, SIGHUP, SIGPIPE, SIGCHLD}) {
+        sigaddset(&defaults, sig);
+    }
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+
+    pid_t pid;
+    int result;
+    runOnSpawnThread([&]() {
+        result = posix_spawn(&pid, args[0], &actions, &attr, args.data(), environ);
+    });
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (result != 0) {
+        error = std::strerror(result);
+        return false;
+    }
+
+    child.pid = pid;
+    child.pidfd = openPidfd(pid);
+    child.status = 0;
+    return true;
+}
+
+// Trampolín de spawnProcess(): argv = {exe, --exec-child, pid del lanzador,
+// programa, argumentos...}. PR_SET_PDEATHSIG sobrevive al exec
+static int execChild(char* argv[]) {
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    // Si el lanzador murió antes del prctl la señal ya no llegará
+    if (getppid() != static_cast<pid_t>(std::atoi(argv[2]))) return 127;
+    execv(argv[3], argv + 3);
+    std::cerr << "[ERROR] Cannot execute " << argv[3] << ": " << std::strerror(errno) << std::endl;
+    return 127;
+}
+
+// Ejecuta argv y devuelve su salida (stdout y stderr juntos); para sondeos
+// cortos como "-device X,help". Pasado el plazo se mata al proceso
+static bool captureOutput(const std::vector<std::string>& argv, std::string& output, int timeoutMs) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) return false;
+    std::vector<char*> args;
+    for (const auto& arg : argv) {
+        args.push_back(const_cast<char*>(arg.c_str()));
+    }
+    args.push_back(nullptr);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDERR_FILENO);
+    pid_t pid;
+    int result = posix_spawnp(&pid, args[0], &actions, nullptr, args.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    if (result != 0) {
+        close(fds[0]);
+        return false;
+    }
+
+    auto deadline = Clock::now() + std::chrono::milliseconds(timeoutMs);
+    char buf[4096];
+    while (true) {
+        pollfd pfd = {fds[0], POLLIN, 0};
+        int waitMs = remainingMs(deadline);
+        if (waitMs == 0 || poll(&pfd, 1, waitMs) <= 0) {
+            kill(pid, SIGKILL);
+            break;
+        }
+        ssize_t n = read(fds[0], buf, sizeof(buf));
+        if (n <= 0) break;
+        output.append(buf, n);
+    }
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static std::string jsonEscape(const std::string& value) {
+    std::string out;
+    for (char c : value) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\t': out += "\\t"; break;
+            default: out += c;
+        }
+    }
+    return out;
+}
+
+// Índice justo después del valor JSON que empieza en pos
+static size_t jsonSkipValue(const std::string& json, size_t pos) {
+    if (pos >= json.size()) return json.size();
+    if (json[pos] == '"') {
+        for (size_t i = pos + 1; i < json.size(); i++) {
+            if (json[i] == '\\') i++;
+            else if (json[i] == '"') return i + 1;
+        }
+        return json.size();
+    }
+    if (json[pos] == '{' || json[pos] == '[') {
+        int depth = 0;
+        bool inString = false;
+        for (size_t i = pos; i < json.size(); i++) {
+            char c = json[i];
+            if (inString) {
+                if (c == '\\') i++;
+                else if (c == '"') inString = false;
+            } else if (c == '"') {
+                inString = true;
+            } else if (c == '{' || c == '[') {
+                depth++;
+            } else if ((c == '}' || c == ']') && --depth == 0) {
+                return i + 1;
+            }
+        }
+        return json.size();
+    }
+    size_t end = json.find_first_of(",}] \t\r\n", pos);
+    return end == std::string::npos ? json.size() : end;
+}
+
+static std::string jsonValue(const std::string& json, size_t begin, size_t end) {
+    if (begin < end && json[begin] == '"') {
+        std::string out;
+        for (size_t i = begin + 1; i + 1 < end; i++) {
+            if (json[i] == '\\' && i + 2 < end) i++;
+            out += json[i];
+        }
+        return out;
+    }
+    return json.substr(begin, end - begin);
+}
+
+// Devuelve el valor crudo de "key" (objeto, string sin comillas o literal).
+// Solo mira las claves del objeto exterior: "props" de query-cpus-fast
+// también tiene un "thread-id" que no es el del hilo
+static std::string jsonField(const std::string& json, const std::string& key) {
+    const char* ws = " \t\r\n";
+    size_t pos = json.find_first_not_of(ws);
+    if (pos == std::string::npos || json[pos] != '{') return "";
+    pos++;
+
+    while (true) {
+        pos = json.find_first_not_of(ws, pos);
+        if (pos == std::string::npos || json[pos] != '"') return "";
+        size_t keyEnd = jsonSkipValue(json, pos);
+        std::string name = jsonValue(json, pos, keyEnd);
+
+        pos = json.find_first_not_of(ws, keyEnd);
+        if (pos == std::string::npos || json[pos] != ':') return "";
+        pos = json.find_first_not_of(ws, pos + 1);
+        if (pos == std::string::npos) return "";
+        size_t end = jsonSkipValue(json, pos);
+        if (name == key) return jsonValue(json, pos, end);
+
+        pos = json.find_first_not_of(ws, end);
+        if (pos == std::string::npos || json[pos] != ',') return "";
+        pos++;
+    }
+}
+
+// Elementos de un array JSON, cada uno como texto crudo
+static std::vector<std::string> jsonArrayItems(const std::string& json) {
+    std::vector<std::string> items;
+    const char* ws = " \t\r\n";
+    size_t pos = json.find_first_not_of(ws);
+    if (pos == std::string::npos || json[pos] != '[') return items;
+    pos++;
+
+    while (true) {
+        pos = json.find_first_not_of(ws, pos);
+        if (pos == std::string::npos || json[pos] == ']') return items;
+        size_t end = jsonSkipValue(json, pos);
+        items.push_back(json.substr(pos, end - pos));
+        pos = json.find_first_not_of(ws, end);
+        if (pos == std::string::npos || json[pos] != ',') return items;
+        pos++;
+    }
+}
+
+// Lee exactamente size bytes o falla al agotarse el plazo
+static bool readExact(int fd, void* data, size_t size, Clock::time_point deadline) {
+    char* out = static_cast<char*>(data);
+    while (size > 0) {
+        if (pollInterruptible(fd, POLLIN, remainingMs(deadline)) <= 0) return false;
+        ssize_t n = read(fd, out, size);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+        if (n <= 0) return false;
+        out += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Intenta una conexión TCP no bloqueante; true si el puerto acepta conexiones
+static bool probeTCPPort(const std::string& host, int port, Clock::time_point deadline) {
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) return false;
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return false;
+
+    bool connected = false;
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) {
+        connected = true;
+    } else if (errno == EINPROGRESS) {
+        pollfd pfd = {fd, POLLOUT, 0};
+        if (poll(&pfd, 1, remainingMs(deadline)) == 1) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            connected = (err == 0);
+        }
+    }
+    close(fd);
+    return connected;
+}
+
+// Cliente mínimo del QEMU Machine Protocol sobre socket UNIX
+class QMPClient {
 private:
-    std::string diskPath;
-    std::string romPath;
-    std::string firmwarePath;
-    std::string noVNCPath;
-    bool useVNC;
-    pid_t qemuPid;
-    pid_t websockifyPid;
+    int fd;
+    std::string buffer;
+    std::vector<std::string> events;
+
+    bool readLine(std::string& line, Clock::time_point deadline) {
+        while (true) {
+            size_t nl = buffer.find('\n');
+            if (nl != std::string::npos) {
+                line = buffer.substr(0, nl);
+                buffer.erase(0, nl + 1);
+                return true;
+            }
+            int ready = pollInterruptible(fd, POLLIN, remainingMs(deadline));
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready <= 0) return false;
+            char chunk[4096];
+            ssize_t n = read(fd, chunk, sizeof(chunk));
+            if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+            if (n <= 0) {
+                disconnect();
+                return false;
+            }
+            buffer.append(chunk, n);
+        }
+    }
+
+    bool sendLine(const std::string& line) {
+        std::string data = line + "\n";
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && errno == EAGAIN) {
+                pollfd pfd = {fd, POLLOUT, 0};
+                poll(&pfd, 1, 100);
+                continue;
+            }
+            if (n <= 0) return false;
+            sent += n;
+        }
+        return true;
+    }
+
+public:
+    QMPClient() : fd(-1) {}
+    ~QMPClient() { disconnect(); }
+
+    QMPClient(const QMPClient&) = delete;
+    QMPClient& operator=(const QMPClient&) = delete;
+
+    bool connectTo(const std::string& path) {
+        disconnect();
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) return false;
+        std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) return false;
+        if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            disconnect();
+            return false;
+        }
+        return true;
+    }
+
+    // Lee el saludo de QEMU y entra en modo comando
+    bool handshake(Clock::time_point deadline) {
+        std::string greeting;
+        if (!readLine(greeting, deadline) || greeting.find("\"QMP\"") == std::string::npos) {
+            return false;
+        }
+        std::string reply;
+        return execute("qmp_capabilities", reply, deadline);
+    }
+
+    bool execute(const std::string& command, std::string& reply, Clock::time_point deadline,
+                 const std::string& arguments = "") {
+        if (fd < 0) return false;
+        std::string request = "{\"execute\": \"" + command + "\"";
+        if (!arguments.empty()) request += ", \"arguments\": " + arguments;
+        request += "}";
+        if (!sendLine(request)) return false;
+
+        std::string line;
+        while (readLine(line, deadline)) {
+            if (line.find("\"event\"") != std::string::npos) {
+                events.push_back(line);
+                continue;
+            }
+            if (line.find("\"return\"") != std::string::npos) {
+                reply = jsonField(line, "return");
+                return true;
+            }
+            if (line.find("\"error\"") != std::string::npos) {
+                reply = jsonField(jsonField(line, "error"), "desc");
+                return false;
+            }
+        }
+        reply = "timeout or connection closed";
+        return false;
+    }
+
+    // Espera un evento asíncrono (p.ej. SHUTDOWN), incluidos los ya recibidos;
+    // en data queda su campo "data"
+    bool waitEvent(const std::string& name, Clock::time_point deadline, std::string* data = nullptr) {
+        for (auto it = events.begin(); it != events.end(); ++it) {
+            if (jsonField(*it, "event") == name) {
+                if (data) *data = jsonField(*it, "data");
+                events.erase(it);
+                return true;
+            }
+        }
+        std::string line;
+        while (fd >= 0 && readLine(line, deadline)) {
+            if (jsonField(line, "event") == name) {
+                if (data) *data = jsonField(line, "data");
+                return true;
+            }
+            if (line.find("\"event\"") != std::string::npos) events.push_back(line);
+        }
+        return false;
+    }
+
+    bool isConnected() const { return fd >= 0; }
+
+    // Para vigilar eventos desde un EventLoop
+    int descriptor() const { return fd; }
+
+    void disconnect() {
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+        buffer.clear();
+    }
+};
+
+// Una instancia de QEMU con su propio socket QMP, log, NVRAM y display VNC
+struct QEMUInstance {
+    int id;
+    std::string qmpSocketPath;
+    std::string logPath;
+    std::string varsPath;
+    std::string vncSocketPath; // VNC por socket UNIX; vncDisplay si está vacío
+    int vncDisplay;
+    bool paused; // lanzada con -S y sin disco ni ISO (pool)
+    bool poweredOff; // el invitado se apagó y QEMU sigue vivo por -no-shutdown
+    std::string overlayPath;
+    std::string diskPath; // disco conectado en escritura, sin overlay (pool)
+    ChildProcess process;
+    QMPClient qmp;
+
+    QEMUInstance() : id(0), vncDisplay(1), paused(false), poweredOff(false) {}
+};
+
+// Bucle epoll: cada descriptor registrado tiene su callback. Sin temporizadores,
+// así que el proceso no despierta mientras no haya eventos
+class EventLoop {
+private:
+    int epfd;
+    bool stopping;
+    std::unordered_map<int, std::function<void(uint32_t)>> handlers;
+    std::vector<std::function<void(uint32_t)>> retired;
+
+public:
+    EventLoop() : epfd(epoll_create1(EPOLL_CLOEXEC)), stopping(false) {}
+    ~EventLoop() {
+        if (epfd >= 0) close(epfd);
+    }
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    bool add(int fd, uint32_t events, std::function<void(uint32_t)> handler) {
+        epoll_event ev = {};
+        ev.events = events;
+        ev.data.fd = fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) return false;
+        handlers[fd] = std::move(handler);
+        return true;
+    }
+
+    bool modify(int fd, uint32_t events) {
+        epoll_event ev = {};
+        ev.events = events;
+        ev.data.fd = fd;
+        return epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == 0;
+    }
+
+    // Se puede llamar desde un callback, incluso el del propio fd
+    void remove(int fd) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+        auto it = handlers.find(fd);
+        if (it != handlers.end()) {
+            retired.push_back(std::move(it->second));
+            handlers.erase(it);
+        }
+    }
+
+    void stop() { stopping = true; }
+
+    void run() {
+        epoll_event events[64];
+        stopping = false;
+        while (!stopping) {
+            int n = epoll_wait(epfd, events, 64, -1);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            for (int i = 0; i < n && !stopping; i++) {
+                auto it = handlers.find(events[i].data.fd);
+                if (it != handlers.end()) it->second(events[i].events);
+            }
+            retired.clear();
+        }
+    }
+};
+
+static sigset_t supervisedSignals() {
+    sigset_t mask;
+    sigemptyset(&mask);
+    for (int sig : {SIGINT, SIGTERM, SIGHUP, SIGCHLD}) {
+        sigaddset(&mask, sig);
+    }
+    return mask;
+}
+
+static int openSignalfd() {
+    sigset_t mask = supervisedSignals();
+    return signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+// Socket UNIX de control sobre un EventLoop: una orden por línea, una respuesta por línea
+class ControlServer {
+private:
+    EventLoop& loop;
+    int listenFd;
+    std::string path;
+    std::function<std::string(const std::string&)> handler;
+    std::unordered_map<int, std::string> clients;
+    std::unordered_map<uint64_t, int> waiting; // respuestas diferidas: ticket → cliente
+    std::unordered_map<int, std::string> replies; // lo que falta por enviar de cada respuesta
+    uint64_t nextTicket;
+    int current; // cliente cuya orden se está atendiendo
+    bool deferred;
+
+    void closeClient(int fd) {
+        loop.remove(fd);
+        clients.erase(fd);
+        replies.erase(fd);
+        for (auto it = waiting.begin(); it != waiting.end(); ++it) {
+            if (it->second == fd) {
+                waiting.erase(it);
+                break;
+            }
+        }
+        close(fd);
+    }
+
+    void sendReply(int fd, const std::string& text) {
+        replies[fd] = text + "\n";
+        flushReply(fd);
+    }
+
+    // Sin bloquear el bucle: si el cliente no lee, el resto sale con EPOLLOUT
+    void flushReply(int fd) {
+        std::string& pending = replies[fd];
+        while (!pending.empty()) {
+            ssize_t n = send(fd, pending.data(), pending.size(), MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && errno == EAGAIN) {
+                loop.modify(fd, EPOLLOUT);
+                return;
+            }
+            if (n <= 0) break;
+            pending.erase(0, n);
+        }
+        closeClient(fd);
+    }
+
+    void onClient(int fd) {
+        if (replies.count(fd)) {
+            flushReply(fd);
+            return;
+        }
+        // Con la respuesta diferida sólo se despierta si el cliente se fue
+        for (const auto& entry : waiting) {
+            if (entry.second == fd) {
+                closeClient(fd);
+                return;
+            }
+        }
+        char chunk[1024];
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+        if (n <= 0) {
+            closeClient(fd);
+            return;
+        }
+        std::string& buffer = clients[fd];
+        buffer.append(chunk, n);
+        size_t nl = buffer.find('\n');
+        if (nl == std::string::npos) {
+            if (buffer.size() > 4096) closeClient(fd);
+            return;
+        }
+        current = fd;
+        deferred = false;
+        std::string reply = handler(buffer.substr(0, nl));
+        current = -1;
+        if (deferred) {
+            // Sólo interesa saber si el cliente se va antes de la respuesta
+            loop.modify(fd, EPOLLRDHUP);
+            return;
+        }
+        sendReply(fd, reply);
+    }
+
+public:
+    explicit ControlServer(EventLoop& eventLoop)
+        : loop(eventLoop), listenFd(-1), nextTicket(1), current(-1), deferred(false) {}
+    ~ControlServer() {
+        while (!clients.empty()) closeClient(clients.begin()->first);
+        if (listenFd >= 0) {
+            loop.remove(listenFd);
+            close(listenFd);
+            unlink(path.c_str());
+        }
+    }
+
+    ControlServer(const ControlServer&) = delete;
+    ControlServer& operator=(const ControlServer&) = delete;
+
+    bool listen(const std::string& socketPath, std::function<std::string(const std::string&)> onCommand) {
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(addr.sun_path)) return false;
+        std::strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+
+        unlink(socketPath.c_str());
+        listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listenFd < 0) return false;
+        if (bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(listenFd, 16) != 0) {
+            close(listenFd);
+            listenFd = -1;
+            return false;
+        }
+        path = socketPath;
+        handler = std::move(onCommand);
+        return loop.add(listenFd, EPOLLIN, [this](uint32_t) {
+            int fd;
+            while ((fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                clients[fd] = "";
+                loop.add(fd, EPOLLIN, [this, fd](uint32_t) { onClient(fd); });
+            }
+        });
+    }
+
+    // Desde el manejador: la orden se contestará más tarde con respond(),
+    // sin bloquear el bucle. Lo que devuelva el manejador se ignora
+    uint64_t deferReply() {
+        deferred = true;
+        waiting[nextTicket] = current;
+        return nextTicket++;
+    }
+
+    // false si el cliente ya se fue
+    bool respond(uint64_t ticket, const std::string& reply) {
+        auto it = waiting.find(ticket);
+        if (it == waiting.end()) return false;
+        int fd = it->second;
+        waiting.erase(it);
+        sendReply(fd, reply);
+        return true;
+    }
+};
+
+// Envía una orden al socket de control de un Computer en marcha e imprime la respuesta
+static int sendControlCommand(const std::string& socketPath, const std::string& command) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        std::cerr << "[ERROR] Cannot connect to " << socketPath << ": " << std::strerror(errno) << std::endl;
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    std::string line = command + "\n";
+    send(fd, line.data(), line.size(), MSG_NOSIGNAL);
+
+    std::string reply;
+    char chunk[1024];
+    ssize_t n;
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0) {
+        reply.append(chunk, n);
+    }
+    close(fd);
+    std::cout << reply;
+    return reply.compare(0, 2, "ok") == 0 ? 0 : 1;
+}
+
+// "20G", "512M", "64K" o bytes; 0 si el texto no es válido
+static uint64_t parseSize(const std::string& text) {
+    if (text.empty()) return 0;
+    char* end = nullptr;
+    double value = std::strtod(text.c_str(), &end);
+    if (end == text.c_str() || value <= 0) return 0;
+    uint64_t unit = 1;
+    switch (*end) {
+        case 'k': case 'K': unit = 1ULL << 10; end++; break;
+        case 'm': case 'M': unit = 1ULL << 20; end++; break;
+        case 'g': case 'G': unit = 1ULL << 30; end++; break;
+        case 't': case 'T': unit = 1ULL << 40; end++; break;
+    }
+    if (*end == 'i' || *end == 'B') end++;
+    if (*end == 'B') end++;
+    if (*end != '\0') return 0;
+    return static_cast<uint64_t>(value * unit);
+}
+
+// Entero decimal entre minimum y maximum, sin nada detrás
+static bool parseInt(const std::string& text, int minimum, int maximum, int& value) {
+    char* end = nullptr;
+    errno = 0;
+    long parsed = std::strtol(text.c_str(), &end, 10);
+    if (end == text.c_str() || *end != '\0' || errno == ERANGE || parsed < minimum || parsed > maximum) {
+        return false;
+    }
+    value = static_cast<int>(parsed);
+    return true;
+}
+
+static std::string formatSize(uint64_t bytes) {
+    const char* units[] = {"B", "K", "M", "G", "T"};
+    int unit = 0;
+    while (unit < 4 && bytes >= 1024 && bytes % 1024 == 0) {
+        bytes /= 1024;
+        unit++;
+    }
+    return std::to_string(bytes) + units[unit];
+}
+
+static uint64_t fnv1a64(const std::string& data) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Ficheros de metadatos "clave=valor", uno por línea
+static bool writeKeyValueFile(const std::string& path, const std::map<std::string, std::string>& values) {
+    std::ofstream out(path, std::ios::trunc);
+    for (const auto& entry : values) {
+        out << entry.first << "=" << entry.second << "\n";
+    }
+    return static_cast<bool>(out);
+}
+
+static std::map<std::string, std::string> readKeyValueFile(const std::string& path) {
+    std::map<std::string, std::string> values;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t eq = line.find('=');
+        if (eq != std::string::npos) values[line.substr(0, eq)] = line.substr(eq + 1);
+    }
+    return values;
+}
+
+// io_uring puede faltar en el kernel o estar deshabilitado (io_uring_disabled)
+static bool probeIoUring() {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    int fd = static_cast<int>(syscall(SYS_io_uring_setup, 1, &params));
+    if (fd < 0) return false;
+    close(fd);
+    return true;
+}
+
+// /dev/kvm puede faltar, no ser accesible (contenedores) o hablar otra API
+static bool probeKVM(std::string& reason) {
+    int fd = open("/dev/kvm", O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        reason = std::string("/dev/kvm: ") + std::strerror(errno);
+        return false;
+    }
+    int version = ioctl(fd, KVM_GET_API_VERSION, 0);
+    close(fd);
+    if (version != KVM_API_VERSION) {
+        reason = version < 0 ? std::string("KVM_GET_API_VERSION: ") + std::strerror(errno)
+                             : "unsupported KVM API version " + std::to_string(version);
+        return false;
+    }
+    return true;
+}
+
+// tmpfs y algunos sistemas de ficheros FUSE rechazan O_DIRECT con EINVAL
+static bool supportsDirectIO(const std::string& dir) {
+    std::string probe = dir + "/.direct-io-probe";
+    int fd = open(probe.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_DIRECT | O_CLOEXEC, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        unlink(probe.c_str());
+        fd = open(probe.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_DIRECT | O_CLOEXEC, 0600);
+    }
+    if (fd < 0) return false;
+    close(fd);
+    unlink(probe.c_str());
+    return true;
+}
+
+// Crea imágenes qcow2 v3 vacías sin depender de qemu-img
+class Qcow2Writer {
+public:
+    struct Options {
+        uint64_t virtualSize;
+        int clusterBits;
+        std::string preallocation = "off"; // off, metadata o falloc
+        bool lazyRefcounts = false;
+        bool extendedL2 = false;
+        std::string backingFile{}; // overlay: los clusters sin asignar se leen de aquí
+        std::string backingFormat = "qcow2";
+    };
+
+private:
+    static void put32(std::vector<char>& buf, size_t off, uint32_t v) {
+        for (int i = 0; i < 4; i++) buf[off + i] = static_cast<char>(v >> (24 - 8 * i));
+    }
+
+    static void put64(std::vector<char>& buf, size_t off, uint64_t v) {
+        for (int i = 0; i < 8; i++) buf[off + i] = static_cast<char>(v >> (56 - 8 * i));
+    }
+
+    static uint64_t divUp(uint64_t a, uint64_t b) {
+        return (a + b - 1) / b;
+    }
+
+    static constexpr uint64_t copiedFlag = 1ULL << 63;
+
+public:
+    static bool create(const std::string& path, const Options& options, std::string& error) {
+        if (options.clusterBits < 9 || options.clusterBits > 21) {
+            error = "cluster size must be between 512 bytes and 2 MiB";
+            return false;
+        }
+        if (options.virtualSize == 0) {
+            error = "virtual size must be greater than zero";
+            return false;
+        }
+        if (options.preallocation != "off" && options.preallocation != "metadata" &&
+            options.preallocation != "falloc") {
+            error = "preallocation must be off, metadata or falloc";
+            return false;
+        }
+        // 32 subclusters por cluster y de al menos 512 bytes
+        if (options.extendedL2 && options.clusterBits < 14) {
+            error = "extended L2 entries need clusters of 16 KiB or more";
+            return false;
+        }
+        // Cabecera, extensión de formato del backing y su nombre en el primer cluster
+        const uint64_t backingNameOffset = 104 + 16 + 8;
+        if (!options.backingFile.empty()) {
+            if (options.backingFile.size() > 1023 ||
+                backingNameOffset + options.backingFile.size() > (1ULL << options.clusterBits)) {
+                error = "backing file name is too long";
+                return false;
+            }
+            if (options.backingFormat.empty() || options.backingFormat.size() > 8) {
+                error = "invalid backing file format";
+                return false;
+            }
+            if (options.preallocation != "off") {
+                error = "a preallocated overlay would hide its backing file";
+                return false;
+            }
+        }
+
+        const uint64_t clusterSize = 1ULL << options.clusterBits;
+        const uint64_t size = divUp(options.virtualSize, 512) * 512;
+        const uint64_t entrySize = options.extendedL2 ? 16 : 8;
+        const uint64_t l2Entries = clusterSize / entrySize;
+        const uint64_t l1Size = divUp(size, clusterSize * l2Entries);
+        const uint64_t l1Clusters = divUp(l1Size * 8, clusterSize);
+        const uint64_t refcountsPerBlock = clusterSize / 2; // refcount_order 4 = 16 bits
+
+        // Con preasignación las tablas L2 ya apuntan a todos los clusters de datos
+        const bool preallocate = options.preallocation != "off";
+        const uint64_t dataClusters = preallocate ? divUp(size, clusterSize) : 0;
+        const uint64_t l2Clusters = preallocate ? l1Size : 0;
+
+        // La tabla y los bloques de refcount también se cuentan a sí mismos
+        uint64_t tableClusters = 1;
+        uint64_t blockClusters = 1;
+        while (true) {
+            uint64_t total = 1 + tableClusters + blockClusters + l1Clusters + l2Clusters + dataClusters;
+            uint64_t blocks = divUp(total, refcountsPerBlock);
+            uint64_t table = divUp(blocks * 8, clusterSize);
+            if (blocks == blockClusters && table == tableClusters) break;
+            blockClusters = blocks;
+            tableClusters = table;
+        }
+        const uint64_t metadataClusters = 1 + tableClusters + blockClusters + l1Clusters + l2Clusters;
+        const uint64_t totalClusters = metadataClusters + dataClusters;
+        const uint64_t tableOffset = clusterSize;
+        const uint64_t blockOffset = tableOffset + tableClusters * clusterSize;
+        const uint64_t l1Offset = blockOffset + blockClusters * clusterSize;
+        const uint64_t l2Offset = l1Offset + l1Clusters * clusterSize;
+        const uint64_t dataOffset = l2Offset + l2Clusters * clusterSize;
+
+        // En memoria sólo los metadatos; los datos quedan como hueco o fallocate
+        std::vector<char> image(metadataClusters * clusterSize, 0);
+
+        // Cabecera v3 (104 bytes) seguida del marcador de fin de extensiones
+        put32(image, 0, 0x514649fb);
+        put32(image, 4, 3);
+        put32(image, 20, options.clusterBits);
+        put64(image, 24, size);
+        put32(image, 36, static_cast<uint32_t>(l1Size));
+        put64(image, 40, l1Offset);
+        put64(image, 48, tableOffset);
+        put32(image, 56, static_cast<uint32_t>(tableClusters));
+        put64(image, 72, options.extendedL2 ? 1ULL << 4 : 0);
+        put64(image, 80, options.lazyRefcounts ? 1 : 0);
+        put32(image, 96, 4);
+        put32(image, 100, 104);
+        if (!options.backingFile.empty()) {
+            put64(image, 8, backingNameOffset);
+            put32(image, 16, static_cast<uint32_t>(options.backingFile.size()));
+            put32(image, 104, 0xe2792aca); // extensión "backing file format"
+            put32(image, 108, static_cast<uint32_t>(options.backingFormat.size()));
+            std::memcpy(image.data() + 112, options.backingFormat.data(), options.backingFormat.size());
+            std::memcpy(image.data() + backingNameOffset, options.backingFile.data(), options.backingFile.size());
+        }
+
+        for (uint64_t i = 0; i < blockClusters; i++) {
+            put64(image, tableOffset + i * 8, blockOffset + i * clusterSize);
+        }
+        for (uint64_t i = 0; i < totalClusters; i++) {
+            image[blockOffset + i * 2 + 1] = 1;
+        }
+        for (uint64_t i = 0; i < l2Clusters; i++) {
+            put64(image, l1Offset + i * 8, (l2Offset + i * clusterSize) | copiedFlag);
+        }
+        for (uint64_t i = 0; i < dataClusters; i++) {
+            put64(image, l2Offset + i * entrySize, (dataOffset + i * clusterSize) | copiedFlag);
+            // Todos los subclusters asignados; el hueco del fichero se lee como ceros
+            if (options.extendedL2) put64(image, l2Offset + i * entrySize + 8, 0xffffffffULL);
+        }
+
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            error = std::strerror(errno);
+            return false;
+        }
+        auto fail = [&](int err) {
+            error = std::strerror(err);
+            close(fd);
+            unlink(path.c_str());
+            return false;
+        };
+        size_t written = 0;
+        while (written < image.size()) {
+            ssize_t n = write(fd, image.data() + written, image.size() - written);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return fail(errno);
+            written += n;
+        }
+        if (preallocate) {
+            uint64_t dataBytes = dataClusters * clusterSize;
+            if (options.preallocation == "falloc") {
+                int err = posix_fallocate(fd, static_cast<off_t>(dataOffset), static_cast<off_t>(dataBytes));
+                if (err != 0) return fail(err);
+            } else if (ftruncate(fd, static_cast<off_t>(dataOffset + dataBytes)) != 0) {
+                return fail(errno);
+            }
+        }
+        if (close(fd) != 0) {
+            error = std::strerror(errno);
+            unlink(path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Relee una imagen recién creada: cabecera, tabla y bloques de refcount,
+    // L1 y L2. Cada cluster referenciado debe tener refcount 1 y ninguno
+    // más; es lo mismo que comprueba "qemu-img check" en una imagen sin
+    // snapshots ni clusters comprimidos
+    static bool verify(const std::string& path, std::string& error) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            error = std::strerror(errno);
+            return false;
+        }
+        struct stat st = {};
+        fstat(fd, &st);
+        auto readAt = [fd](uint64_t offset, size_t size, std::vector<unsigned char>& out) {
+            out.assign(size, 0);
+            return pread(fd, out.data(), size, static_cast<off_t>(offset)) == static_cast<ssize_t>(size);
+        };
+        auto get64 = [](const std::vector<unsigned char>& buf, size_t off) {
+            uint64_t v = 0;
+            for (int i = 0; i < 8; i++) v = (v << 8) | buf[off + i];
+            return v;
+        };
+        auto get32 = [&get64](const std::vector<unsigned char>& buf, size_t off) {
+            return static_cast<uint32_t>(get64(buf, off) >> 32);
+        };
+        auto fail = [&](const std::string& message) {
+            error = message;
+            close(fd);
+            return false;
+        };
+
+        std::vector<unsigned char> header;
+        if (!readAt(0, 104, header) || get32(header, 0) != 0x514649fb || get32(header, 4) != 3) {
+            return fail("not a qcow2 v3 image");
+        }
+        const int clusterBits = static_cast<int>(get32(header, 20));
+        if (clusterBits < 9 || clusterBits > 21 || get32(header, 96) != 4) {
+            return fail("unexpected cluster size or refcount width");
+        }
+        const uint64_t clusterSize = 1ULL << clusterBits;
+        const uint64_t entrySize = (get64(header, 72) & (1ULL << 4)) ? 16 : 8;
+        const uint64_t l1Size = get32(header, 36);
+        const uint64_t l1Offset = get64(header, 40);
+        const uint64_t tableOffset = get64(header, 48);
+        const uint64_t tableClusters = get32(header, 56);
+        const uint64_t offsetMask = 0x00fffffffffffe00ULL;
+        if (l1Size < divUp(get64(header, 24), clusterSize * (clusterSize / entrySize))) {
+            return fail("L1 table does not cover the virtual size");
+        }
+
+        // Veces que los metadatos referencian cada cluster
+        std::vector<uint32_t> referenced;
+        std::string misaligned;
+        auto use = [&](uint64_t offset, uint64_t count) {
+            if (offset % clusterSize) misaligned = std::to_string(offset);
+            uint64_t first = offset / clusterSize;
+            if (referenced.size() < first + count) referenced.resize(first + count, 0);
+            for (uint64_t i = 0; i < count; i++) referenced[first + i]++;
+        };
+        use(0, 1);
+        use(tableOffset, tableClusters);
+        std::vector<unsigned char> table;
+        if (!readAt(tableOffset, tableClusters * clusterSize, table)) return fail("cannot read refcount table");
+        for (uint64_t i = 0; i < table.size() / 8; i++) {
+            if (get64(table, i * 8)) use(get64(table, i * 8), 1);
+        }
+        use(l1Offset, divUp(l1Size * 8, clusterSize));
+        std::vector<unsigned char> l1, l2;
+        if (!readAt(l1Offset, l1Size * 8, l1)) return fail("cannot read L1 table");
+        for (uint64_t i = 0; i < l1Size; i++) {
+            uint64_t l2Offset = get64(l1, i * 8) & offsetMask;
+            if (!l2Offset) continue;
+            use(l2Offset, 1);
+            if (!readAt(l2Offset, clusterSize, l2)) return fail("cannot read L2 table " + std::to_string(i));
+            for (uint64_t j = 0; j < clusterSize / entrySize; j++) {
+                uint64_t entry = get64(l2, j * entrySize);
+                if (entry & (1ULL << 62)) return fail("unexpected compressed cluster");
+                if (entry & offsetMask) use(entry & offsetMask, 1);
+            }
+        }
+        if (!misaligned.empty()) return fail("misaligned metadata offset " + misaligned);
+
+        // Refcounts guardados frente a los contados, en todo el fichero
+        const uint64_t perBlock = clusterSize / 2;
+        const uint64_t clusters = std::max<uint64_t>(referenced.size(), divUp(st.st_size, clusterSize));
+        std::vector<unsigned char> block;
+        uint64_t loaded = UINT64_MAX;
+        for (uint64_t i = 0; i < clusters; i++) {
+            uint64_t index = i / perBlock;
+            uint64_t blockOffset = index < table.size() / 8 ? get64(table, index * 8) : 0;
+            if (blockOffset && index != loaded) {
+                if (!readAt(blockOffset, clusterSize, block)) return fail("cannot read refcount block");
+                loaded = index;
+            }
+            uint32_t stored = blockOffset ? (block[(i % perBlock) * 2] << 8) | block[(i % perBlock) * 2 + 1] : 0;
+            uint32_t expected = i < referenced.size() ? referenced[i] : 0;
+            if (stored != expected) {
+                return fail("cluster " + std::to_string(i) + " has refcount " + std::to_string(stored) +
+                            " but " + std::to_string(expected) + " references");
+            }
+        }
+        close(fd);
+        return true;
+    }
+};
+
+// Campos de la cabecera de una imagen qcow2 que importan al adjuntarla
+struct Qcow2Header {
+    uint32_t version;
+    int clusterBits;
+    uint64_t virtualSize;
+    uint64_t incompatibleFeatures;
+
+    bool extendedL2() const { return incompatibleFeatures & (1ULL << 4); }
+
+    // Bytes de caché L2 para tener en memoria todas las entradas de la imagen
+    uint64_t l2CoverageBytes() const {
+        uint64_t entries = (virtualSize + (1ULL << clusterBits) - 1) >> clusterBits;
+        return entries * (extendedL2() ? 16 : 8);
+    }
+
+    static bool read(const std::string& path, Qcow2Header& header, std::string& error) {
+        unsigned char buf[104];
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            error = std::strerror(errno);
+            return false;
+        }
+        ssize_t n = pread(fd, buf, sizeof(buf), 0);
+        close(fd);
+        auto get32 = [&](size_t off) {
+            return (uint32_t(buf[off]) << 24) | (uint32_t(buf[off + 1]) << 16) | (uint32_t(buf[off + 2]) << 8) | buf[off + 3];
+        };
+        auto get64 = [&](size_t off) { return (uint64_t(get32(off)) << 32) | get32(off + 4); };
+
+        if (n < 72 || std::memcmp(buf, "QFI\xfb", 4) != 0) {
+            error = "not a qcow2 image";
+            return false;
+        }
+        header.version = get32(4);
+        header.clusterBits = static_cast<int>(get32(20));
+        header.virtualSize = get64(24);
+        header.incompatibleFeatures = (header.version >= 3 && n >= 80) ? get64(72) : 0;
+        if (header.clusterBits < 9 || header.clusterBits > 21) {
+            error = "invalid cluster size";
+            return false;
+        }
+        return true;
+    }
+};
+
+static std::string readFirstLine(const std::string& path) {
+    std::ifstream in(path);
+    std::string line;
+    std::getline(in, line);
+    return line;
+}
+
+// Listas de CPUs/nodos del kernel: "0-3,8-11"
+static std::vector<int> parseCPUList(const std::string& list) {
+    std::vector<int> out;
+    std::stringstream ranges(list);
+    std::string range;
+    while (std::getline(ranges, range, ',')) {
+        if (range.empty()) continue;
+        size_t dash = range.find('-');
+        int first = std::atoi(range.c_str());
+        int last = dash == std::string::npos ? first : std::atoi(range.c_str() + dash + 1);
+        for (int cpu = first; cpu <= last; cpu++) out.push_back(cpu);
+    }
+    return out;
+}
+
+// Topología del host leída de /sys y /proc
+struct HostTopology {
+    struct CPU {
+        int id;
+        int package;
+        int core;
+        int node;
+    };
+
+    std::vector<CPU> cpus;
+    std::map<int, std::vector<int>> nodeCPUs;
+    std::map<int, uint64_t> nodeMemory;
+    int packages;
+    int threadsPerCore;
+    int coresPerCache; // núcleos que comparten la caché de último nivel
+    uint64_t memTotal;
+    uint64_t memAvailable;
+
+    HostTopology() : packages(1), threadsPerCore(1), coresPerCache(1), memTotal(0), memAvailable(0) {}
+
+    static HostTopology detect() {
+        HostTopology host;
+        const std::string base = "/sys/devices/system/cpu/";
+        std::vector<int> online = parseCPUList(readFirstLine(base + "online"));
+        if (online.empty()) {
+            for (unsigned i = 0; i < std::max(1u, std::thread::hardware_concurrency()); i++) online.push_back(i);
+        }
+
+        std::set<int> packageIds;
+        std::map<std::pair<int, int>, int> coreThreads;
+        for (int id : online) {
+            std::string topo = base + "cpu" + std::to_string(id) + "/topology/";
+            std::string package = readFirstLine(topo + "physical_package_id");
+            std::string core = readFirstLine(topo + "core_id");
+            CPU cpu = {id, package.empty() ? 0 : std::atoi(package.c_str()),
+                       core.empty() ? id : std::atoi(core.c_str()), 0};
+            host.cpus.push_back(cpu);
+            packageIds.insert(cpu.package);
+            coreThreads[{cpu.package, cpu.core}]++;
+        }
+        host.packages = static_cast<int>(packageIds.size());
+        for (const auto& entry : coreThreads) {
+            host.threadsPerCore = std::max(host.threadsPerCore, entry.second);
+        }
+
+        // Caché de último nivel: el índice de mayor nivel de cpu0
+        int bestLevel = 0;
+        std::error_code ec;
+        for (const auto& entry : fs::directory_iterator(base + "cpu" + std::to_string(online[0]) + "/cache", ec)) {
+            if (entry.path().filename().string().compare(0, 5, "index") != 0) continue;
+            int level = std::atoi(readFirstLine(entry.path().string() + "/level").c_str());
+            if (level > bestLevel) {
+                bestLevel = level;
+                int sharing = static_cast<int>(parseCPUList(readFirstLine(entry.path().string() + "/shared_cpu_list")).size());
+                host.coresPerCache = std::max(1, sharing / host.threadsPerCore);
+            }
+        }
+
+        for (const auto& entry : fs::directory_iterator("/sys/devices/system/node", ec)) {
+            std::string name = entry.path().filename().string();
+            if (name.compare(0, 4, "node") != 0 || name.size() == 4 || !isdigit(name[4])) continue;
+            int node = std::atoi(name.c_str() + 4);
+            host.nodeCPUs[node] = parseCPUList(readFirstLine(entry.path().string() + "/cpulist"));
+            std::ifstream meminfo(entry.path().string() + "/meminfo");
+            std::string line;
+            while (std::getline(meminfo, line)) {
+                size_t pos = line.find("MemTotal:");
+                if (pos != std::string::npos) host.nodeMemory[node] = std::stoull(line.substr(pos + 9)) * 1024;
+            }
+            for (int cpu : host.nodeCPUs[node]) {
+                for (auto& c : host.cpus) {
+                    if (c.id == cpu) c.node = node;
+                }
+            }
+        }
+
+        std::ifstream meminfo("/proc/meminfo");
+        std::string key;
+        uint64_t value;
+        std::string unit;
+        while (meminfo >> key >> value) {
+            std::getline(meminfo, unit);
+            if (key == "MemTotal:") host.memTotal = value * 1024;
+            if (key == "MemAvailable:") host.memAvailable = value * 1024;
+        }
+        return host;
+    }
+};
+
+// Tamaño de la máquina virtual: vCPUs con su disposición y memoria
+struct MachineSize {
+    int cpus;
+    int sockets;
+    int cores;
+    int threads;
+    uint64_t memory;
+
+    MachineSize() : cpus(4), sockets(1), cores(4), threads(1), memory(4ULL << 30) {}
+
+    // Disposición que respeta el SMT del host y no pone en un socket más
+    // núcleos de los que comparten la caché de último nivel en el host
+    static MachineSize plan(const HostTopology& host, int cpus, uint64_t memory) {
+        MachineSize size;
+        size.cpus = std::max(1, cpus);
+        size.threads = (host.threadsPerCore > 1 && size.cpus % host.threadsPerCore == 0) ? host.threadsPerCore : 1;
+        int cores = size.cpus / size.threads;
+        int sockets = std::max(1, (cores + host.coresPerCache - 1) / host.coresPerCache);
+        while (cores % sockets != 0) sockets++;
+        size.sockets = sockets;
+        size.cores = cores / sockets;
+        size.memory = std::max<uint64_t>(512ULL << 20, memory & ~((1ULL << 20) - 1));
+        return size;
+    }
+};
+
+// "0-3,8" a partir de una lista de CPUs
+static std::string formatCPUList(std::vector<int> cpus) {
+    std::sort(cpus.begin(), cpus.end());
+    std::string out;
+    for (size_t i = 0; i < cpus.size();) {
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) j++;
+        if (!out.empty()) out += ",";
+        out += std::to_string(cpus[i]);
+        if (j > i) out += "-" + std::to_string(cpus[j]);
+        i = j + 1;
+    }
+    return out;
+}
+
+static bool setThreadAffinity(pid_t tid, const std::vector<int>& cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) CPU_SET(cpu, &set);
+    return sched_setaffinity(tid, sizeof(set), &set) == 0;
+}
+
+// Reparto de CPUs del host: una fija por vCPU y un conjunto aparte para los
+// hilos del emulador (bucle principal, E/S), que así no roban tiempo a las vCPUs
+struct PinPlan {
+    std::vector<int> vcpuHost; // índice = cpu-index de QEMU, -1 sin fijar
+    std::vector<int> emulatorCPUs;
+
+    bool enabled() const { return !vcpuHost.empty(); }
+
+    // Mapa explícito "0:2,1:3": vCPU 0 en la CPU 2 del host, vCPU 1 en la 3
+    static bool parse(const std::string& map, const HostTopology& host, int vcpus,
+                      PinPlan& plan, std::string& error) {
+        std::set<int> hostCPUs;
+        for (const auto& cpu : host.cpus) hostCPUs.insert(cpu.id);
+
+        plan.vcpuHost.assign(vcpus, -1);
+        std::stringstream entries(map);
+        std::string entry;
+        while (std::getline(entries, entry, ',')) {
+            size_t colon = entry.find(':');
+            if (colon == std::string::npos) {
+                error = "expected vcpu:cpu, got '" + entry + "'";
+                return false;
+            }
+            int vcpu = std::atoi(entry.c_str());
+            int cpu = std::atoi(entry.c_str() + colon + 1);
+            if (vcpu < 0 || vcpu >= vcpus) {
+                error = "vCPU " + std::to_string(vcpu) + " does not exist";
+                return false;
+            }
+            if (!hostCPUs.count(cpu)) {
+                error = "host CPU " + std::to_string(cpu) + " is not online";
+                return false;
+            }
+            plan.vcpuHost[vcpu] = cpu;
+        }
+
+        plan.emulatorCPUs.clear();
+        for (int cpu : hostCPUs) {
+            if (std::find(plan.vcpuHost.begin(), plan.vcpuHost.end(), cpu) == plan.vcpuHost.end()) {
+                plan.emulatorCPUs.push_back(cpu);
+            }
+        }
+        return true;
+    }
+
+    // Reparto automático por núcleos físicos: si el invitado tiene SMT sus
+    // hilos hermanos caen en los hermanos de un mismo núcleo del host; si no,
+    // una vCPU por núcleo. El núcleo de la CPU 0 (donde el kernel atiende la
+    // mayoría de interrupciones) queda para el emulador si sobran núcleos.
+    // Los núcleos van ordenados por nodo NUMA para que vCPUs consecutivas
+    // compartan nodo
+    static PinPlan automatic(const HostTopology& host, const MachineSize& size) {
+        std::map<std::tuple<int, int, int>, std::vector<int>> coreMap;
+        for (const auto& cpu : host.cpus) coreMap[{cpu.node, cpu.package, cpu.core}].push_back(cpu.id);
+        std::vector<std::vector<int>> cores;
+        std::vector<int> coreNodes;
+        for (auto& entry : coreMap) {
+            std::sort(entry.second.begin(), entry.second.end());
+            cores.push_back(entry.second);
+            coreNodes.push_back(std::get<0>(entry.first));
+        }
+
+        int perCore = size.threads;
+        int coresNeeded = (size.cpus + perCore - 1) / perCore;
+        if (coresNeeded < static_cast<int>(cores.size())) {
+            auto first = std::find_if(cores.begin(), cores.end(), [](const std::vector<int>& siblings) {
+                return siblings.front() == 0;
+            });
+            if (first != cores.end()) {
+                // Al final de su propio nodo, no del host
+                size_t index = first - cores.begin();
+                size_t nodeEnd = index;
+                while (nodeEnd < cores.size() && coreNodes[nodeEnd] == coreNodes[index]) nodeEnd++;
+                std::rotate(first, first + 1, cores.begin() + nodeEnd);
+            }
+        }
+
+        PinPlan plan;
+        std::set<int> used;
+        for (const auto& siblings : cores) {
+            for (int t = 0; t < perCore && t < static_cast<int>(siblings.size()); t++) {
+                if (static_cast<int>(plan.vcpuHost.size()) == size.cpus) break;
+                plan.vcpuHost.push_back(siblings[t]);
+                used.insert(siblings[t]);
+            }
+        }
+        // Más vCPUs que núcleos: se completan con los hermanos SMT libres
+        for (const auto& siblings : cores) {
+            for (int cpu : siblings) {
+                if (static_cast<int>(plan.vcpuHost.size()) == size.cpus) break;
+                if (used.insert(cpu).second) plan.vcpuHost.push_back(cpu);
+            }
+        }
+
+        // El emulador se queda con los núcleos que no toca ninguna vCPU
+        for (const auto& siblings : cores) {
+            bool free = std::none_of(siblings.begin(), siblings.end(), [&](int cpu) { return used.count(cpu); });
+            if (free) plan.emulatorCPUs.insert(plan.emulatorCPUs.end(), siblings.begin(), siblings.end());
+        }
+        return plan;
+    }
+};
+
+// Nodos NUMA del invitado: cada uno con sus vCPUs y un memory-backend ligado
+// al nodo del host donde están fijadas esas vCPUs
+struct NUMALayout {
+    struct Node {
+        int hostNode; // -1: sin política, el kernel decide
+        std::vector<int> vcpus;
+        uint64_t memory;
+    };
+
+    std::vector<Node> nodes;
+
+    // Sin afinidad no se sabe dónde correrán las vCPUs: un solo nodo, ligado
+    // sólo si el host tiene un único nodo
+    static NUMALayout plan(const HostTopology& host, const MachineSize& size, const PinPlan& pins) {
+        NUMALayout layout;
+        if (!pins.enabled()) {
+            Node node = {host.nodeCPUs.size() == 1 ? host.nodeCPUs.begin()->first : -1, {}, size.memory};
+            for (int i = 0; i < size.cpus; i++) node.vcpus.push_back(i);
+            layout.nodes.push_back(node);
+            return layout;
+        }
+
+        std::map<int, int> cpuNode;
+        for (const auto& cpu : host.cpus) cpuNode[cpu.id] = cpu.node;
+        std::map<int, size_t> byHostNode;
+        for (int vcpu = 0; vcpu < size.cpus; vcpu++) {
+            int cpu = vcpu < static_cast<int>(pins.vcpuHost.size()) ? pins.vcpuHost[vcpu] : -1;
+            // Una vCPU sin fijar va al primer nodo del invitado
+            int hostNode = cpu >= 0 ? cpuNode[cpu] : (layout.nodes.empty() ? -1 : layout.nodes[0].hostNode);
+            auto it = byHostNode.find(hostNode);
+            if (it == byHostNode.end()) {
+                it = byHostNode.emplace(hostNode, layout.nodes.size()).first;
+                layout.nodes.push_back({hostNode, {}, 0});
+            }
+            layout.nodes[it->second].vcpus.push_back(vcpu);
+        }
+        if (host.nodeCPUs.empty()) {
+            for (auto& node : layout.nodes) node.hostNode = -1;
+        }
+
+        // Memoria proporcional a las vCPUs de cada nodo, en MiB; el resto al último
+        uint64_t assigned = 0;
+        for (size_t i = 0; i < layout.nodes.size(); i++) {
+            Node& node = layout.nodes[i];
+            if (i + 1 == layout.nodes.size()) {
+                node.memory = size.memory - assigned;
+            } else {
+                node.memory = (size.memory / size.cpus * node.vcpus.size()) & ~((1ULL << 20) - 1);
+            }
+            assigned += node.memory;
+        }
+        return layout;
+    }
+};
+
+// Dónde están de verdad las páginas de la memoria ligada de un proceso,
+// según /proc/<pid>/numa_maps
+struct NUMAPlacement {
+    int boundMappings;
+    std::map<int, uint64_t> nodeBytes;
+    uint64_t localBytes;
+    uint64_t remoteBytes;
+
+    NUMAPlacement() : boundMappings(0), localBytes(0), remoteBytes(0) {}
+
+    // Líneas como "7f2a... bind:1 anon=512 dirty=512 N1=512 kernelpagesize_kB=4"
+    static bool read(pid_t pid, NUMAPlacement& placement) {
+        std::ifstream maps("/proc/" + std::to_string(pid) + "/numa_maps");
+        if (!maps) return false;
+        std::string line;
+        while (std::getline(maps, line)) {
+            std::istringstream fields(line);
+            std::string address, policy, field;
+            fields >> address >> policy;
+            if (policy.compare(0, 5, "bind:") != 0) continue;
+            std::vector<int> allowed = parseCPUList(policy.substr(5));
+
+            std::map<int, uint64_t> pages;
+            uint64_t pageSize = 4096;
+            while (fields >> field) {
+                if (field.size() > 1 && field[0] == 'N' && isdigit(field[1])) {
+                    size_t eq = field.find('=');
+                    if (eq != std::string::npos) pages[std::atoi(field.c_str() + 1)] += std::stoull(field.substr(eq + 1));
+                } else if (field.compare(0, 17, "kernelpagesize_kB") == 0) {
+                    pageSize = std::stoull(field.substr(18)) * 1024;
+                }
+            }
+
+            placement.boundMappings++;
+            for (const auto& entry : pages) {
+                uint64_t bytes = entry.second * pageSize;
+                placement.nodeBytes[entry.first] += bytes;
+                bool local = std::find(allowed.begin(), allowed.end(), entry.first) != allowed.end();
+                (local ? placement.localBytes : placement.remoteBytes) += bytes;
+            }
+        }
+        return true;
+    }
+
+    // "2 bound mappings, N0=512M N1=510M, 0 MB remote"
+    std::string summary() const {
+        std::string out = std::to_string(boundMappings) + " bound mappings,";
+        for (const auto& entry : nodeBytes) {
+            out += " N" + std::to_string(entry.first) + "=" + std::to_string(entry.second >> 20) + "M";
+        }
+        return out + ", " + std::to_string(remoteBytes >> 20) + " MB remote";
+    }
+};
+
+// Páginas grandes del host: montajes hugetlbfs por tamaño de página y modo de THP
+struct HugePageInfo {
+    std::map<uint64_t, std::string> mounts;
+    std::string thpMode; // always, madvise o never
+
+    static HugePageInfo detect() {
+        HugePageInfo info;
+        uint64_t defaultSize = 0;
+        std::ifstream meminfo("/proc/meminfo");
+        std::string key;
+        uint64_t value;
+        std::string unit;
+        while (meminfo >> key >> value) {
+            std::getline(meminfo, unit);
+            if (key == "Hugepagesize:") defaultSize = value * 1024;
+        }
+
+        // "hugetlbfs /dev/hugepages hugetlbfs rw,relatime,pagesize=2M 0 0"
+        std::ifstream mounts("/proc/mounts");
+        std::string device, path, type, options;
+        while (mounts >> device >> path >> type >> options) {
+            std::getline(mounts, unit);
+            if (type != "hugetlbfs") continue;
+            uint64_t pageSize = defaultSize;
+            size_t pos = options.find("pagesize=");
+            if (pos != std::string::npos) {
+                pageSize = parseSize(options.substr(pos + 9, options.find(',', pos) - pos - 9));
+            }
+            if (pageSize && !info.mounts.count(pageSize)) info.mounts[pageSize] = path;
+        }
+
+        std::string thp = readFirstLine("/sys/kernel/mm/transparent_hugepage/enabled");
+        size_t open = thp.find('['), close = thp.find(']');
+        info.thpMode = open != std::string::npos && close > open ? thp.substr(open + 1, close - open - 1) : "never";
+        return info;
+    }
+
+    // Páginas libres y sin reservar de un tamaño, en un nodo o en todo el
+    // host (node < 0). Las reservas de otros procesos sólo se publican en
+    // total: en un nodo no puede haber más que las libres de todo el host
+    static uint64_t freePages(uint64_t pageSize, int node) {
+        std::string name = "hugepages-" + std::to_string(pageSize >> 10) + "kB/";
+        auto read = [](const std::string& path) {
+            std::string count = readFirstLine(path);
+            return count.empty() ? 0ULL : std::stoull(count);
+        };
+        uint64_t free = read("/sys/kernel/mm/hugepages/" + name + "free_hugepages");
+        uint64_t reserved = read("/sys/kernel/mm/hugepages/" + name + "resv_hugepages");
+        uint64_t unreserved = free > reserved ? free - reserved : 0;
+        if (node < 0) return unreserved;
+        uint64_t nodeFree =
+            read("/sys/devices/system/node/node" + std::to_string(node) + "/hugepages/" + name + "free_hugepages");
+        return std::min(nodeFree, unreserved);
+    }
+};
+
+// Línea de tiempo del arranque con reloj monotónico; se exporta como JSON de
+// trace events (chrome://tracing, Perfetto) y como resumen de una línea
+class BootTimeline {
+private:
+    struct Span {
+        std::string name;
+        std::string category;
+        double startUs;
+        double durationUs;
+        int tid;
+    };
+
+    mutable std::mutex mutex;
+    Clock::time_point origin;
+    std::vector<Span> spans;
+    std::map<std::thread::id, int> threads;
+
+    double toUs(Clock::time_point t) const {
+        return std::chrono::duration<double, std::micro>(t - origin).count();
+    }
+
+public:
+    BootTimeline() : origin(Clock::now()) {}
+
+    void reset() {
+        std::lock_guard<std::mutex> lock(mutex);
+        origin = Clock::now();
+        spans.clear();
+    }
+
+    void record(const std::string& name, const std::string& category, Clock::time_point start,
+                Clock::time_point end = Clock::now()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto inserted = threads.emplace(std::this_thread::get_id(), static_cast<int>(threads.size()) + 1);
+        spans.push_back({name, category, toUs(start), toUs(end) - toUs(start), inserted.first->second});
+    }
+
+    bool writeChromeTrace(const std::string& path) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ofstream out(path, std::ios::trunc);
+        out << "{\"traceEvents\": [\n";
+        out << std::fixed << std::setprecision(1);
+        for (size_t i = 0; i < spans.size(); i++) {
+            const Span& span = spans[i];
+            out << "  {\"name\": \"" << jsonEscape(span.name) << "\", \"cat\": \"" << span.category
+                << "\", \"ph\": \"X\", \"ts\": " << span.startUs << ", \"dur\": " << span.durationUs
+                << ", \"pid\": " << getpid() << ", \"tid\": " << span.tid << "}"
+                << (i + 1 < spans.size() ? ",\n" : "\n");
+        }
+        out << "], \"displayTimeUnit\": \"ms\"}\n";
+        return static_cast<bool>(out);
+    }
+
+    // "directories=0.1 ... total=812.3" (ms desde el inicio hasta el final de cada tramo)
+    std::string summary() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(1);
+        double total = 0;
+        for (const auto& span : spans) {
+            double end = (span.startUs + span.durationUs) / 1000.0;
+            out << span.name << "=" << end << " ";
+            total = std::max(total, end);
+        }
+        out << "total=" << total << "ms";
+        return out.str();
+    }
+};
+
+// Grafo de fases de arranque: cada fase corre en su propio hilo en cuanto
+// terminan sus dependencias, y se registra su tiempo para el informe final
+class BootGraph {
+public:
+    struct Phase {
+        std::string name;
+        std::vector<std::string> deps;
+        std::function<bool()> run;
+        enum State { Pending, Running, Done, Failed, Skipped } state;
+        double startMs;
+        double endMs;
+    };
+
+private:
+    std::vector<Phase> phases;
+    std::mutex mutex;
+    std::condition_variable finished;
+    Clock::time_point origin;
+    BootTimeline* timeline;
+
+    double sinceOrigin() const {
+        return std::chrono::duration<double, std::milli>(Clock::now() - origin).count();
+    }
+
+    const Phase* find(const std::string& name) const {
+        for (const auto& phase : phases) {
+            if (phase.name == name) return &phase;
+        }
+        return nullptr;
+    }
+
+public:
+    explicit BootGraph(BootTimeline* bootTimeline = nullptr) : timeline(bootTimeline) {}
+
+    void add(const std::string& name, const std::vector<std::string>& deps, std::function<bool()> run) {
+        phases.push_back({name, deps, std::move(run), Phase::Pending, 0, 0});
+    }
+
+    bool run() {
+        origin = Clock::now();
+        std::vector<std::thread> workers;
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (true) {
+            bool progress = false;
+            int running = 0;
+            for (auto& phase : phases) {
+                if (phase.state == Phase::Running) running++;
+                if (phase.state != Phase::Pending) continue;
+
+                bool ready = true;
+                bool blocked = false;
+                for (const auto& dep : phase.deps) {
+                    const Phase* other = find(dep);
+                    if (!other || other->state == Phase::Failed || other->state == Phase::Skipped) {
+                        blocked = true;
+                    } else if (other->state != Phase::Done) {
+                        ready = false;
+                    }
+                }
+                if (blocked || bootInterrupted()) {
+                    phase.state = Phase::Skipped;
+                    progress = true;
+                } else if (ready) {
+                    phase.state = Phase::Running;
+                    phase.startMs = sinceOrigin();
+                    running++;
+                    progress = true;
+                    Phase* target = &phase;
+                    workers.emplace_back([this, target]() {
+                        auto begin = Clock::now();
+                        bool ok = target->run();
+                        if (timeline) timeline->record(target->name, "phase", begin);
+                        std::lock_guard<std::mutex> guard(mutex);
+                        target->endMs = sinceOrigin();
+                        target->state = ok ? Phase::Done : Phase::Failed;
+                        finished.notify_all();
+                    });
+                }
+            }
+            if (progress) continue;
+            if (running == 0) break;
+            finished.wait(lock);
+        }
+        lock.unlock();
+
+        for (auto& worker : workers) worker.join();
+        for (const auto& phase : phases) {
+            if (phase.state != Phase::Done) return false;
+        }
+        return true;
+    }
+
+    std::vector<std::string> report() const {
+        std::vector<std::string> lines;
+        const Phase* last = nullptr;
+        for (const auto& phase : phases) {
+            std::ostringstream line;
+            line << std::left << std::setw(12) << phase.name << std::right << std::fixed << std::setprecision(1);
+            if (phase.state == Phase::Done || phase.state == Phase::Failed) {
+                line << std::setw(8) << phase.startMs << " -> " << std::setw(8) << phase.endMs
+                     << " ms (" << (phase.endMs - phase.startMs) << " ms)";
+                if (phase.state == Phase::Failed) line << " FAILED";
+                if (!last || phase.endMs > last->endMs) last = &phase;
+            } else {
+                line << "   skipped";
+            }
+            lines.push_back(line.str());
+        }
+
+        // Camino crítico: desde la fase que terminó última, seguir la dependencia más tardía
+        std::string path;
+        for (const Phase* phase = last; phase;) {
+            path = phase->name + (path.empty() ? "" : " -> " + path);
+            const Phase* next = nullptr;
+            for (const auto& dep : phase->deps) {
+                const Phase* other = find(dep);
+                if (other && (!next || other->endMs > next->endMs)) next = other;
+            }
+            phase = next;
+        }
+        if (last) {
+            std::ostringstream line;
+            line << "critical path: " << path << " (" << std::fixed << std::setprecision(1) << last->endMs << " ms)";
+            lines.push_back(line.str());
+        }
+        return lines;
+    }
+};
+
+// SHA-1 (RFC 3174); sólo se usa para Sec-WebSocket-Accept
+static void sha1(const unsigned char* data, size_t size, unsigned char digest[20]) {
+    uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+    auto rol = [](uint32_t v, int n) { return (v << n) | (v >> (32 - n)); };
+    const uint64_t bits = uint64_t(size) * 8;
+    const size_t total = ((size + 8) / 64 + 1) * 64;
+
+    unsigned char block[64];
+    uint32_t w[80];
+    for (size_t offset = 0; offset < total; offset += 64) {
+        // El relleno (0x80, ceros y longitud en bits) se genera al vuelo
+        for (size_t i = 0; i < 64; i++) {
+            size_t pos = offset + i;
+            if (pos < size) block[i] = data[pos];
+            else if (pos == size) block[i] = 0x80;
+            else if (pos >= total - 8) block[i] = static_cast<unsigned char>(bits >> (8 * (total - 1 - pos)));
+            else block[i] = 0;
+        }
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t(block[4 * i]) << 24) | (uint32_t(block[4 * i + 1]) << 16) |
+                   (uint32_t(block[4 * i + 2]) << 8) | block[4 * i + 3];
+        }
+        for (int i = 16; i < 80; i++) w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5a827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8f1bbcdc;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+            uint32_t t = rol(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rol(b, 30);
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    for (int i = 0; i < 5; i++) {
+        for (int j = 0; j < 4; j++) digest[4 * i + j] = static_cast<unsigned char>(h[i] >> (24 - 8 * j));
+    }
+}
+
+static std::string base64Encode(const unsigned char* data, size_t size) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for (size_t i = 0; i < size; i += 3) {
+        uint32_t v = uint32_t(data[i]) << 16;
+        if (i + 1 < size) v |= uint32_t(data[i + 1]) << 8;
+        if (i + 2 < size) v |= data[i + 2];
+        out += alphabet[(v >> 18) & 63];
+        out += alphabet[(v >> 12) & 63];
+        out += i + 1 < size ? alphabet[(v >> 6) & 63] : '=';
+        out += i + 2 < size ? alphabet[v & 63] : '=';
+    }
+    return out;
+}
+
+static std::string webSocketAccept(const std::string& key) {
+    std::string input = key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    unsigned char digest[20];
+    sha1(reinterpret_cast<const unsigned char*>(input.data()), input.size(), digest);
+    return base64Encode(digest, sizeof(digest));
+}
+
+// Valor de una cabecera HTTP sin distinguir mayúsculas en el nombre
+static std::string httpHeader(const std::string& request, const std::string& name) {
+    size_t pos = 0;
+    while ((pos = request.find("\r\n", pos)) != std::string::npos) {
+        pos += 2;
+        if (request.size() - pos < name.size() + 1) break;
+        if (strncasecmp(request.c_str() + pos, name.c_str(), name.size()) == 0 && request[pos + name.size()] == ':') {
+            size_t start = request.find_first_not_of(" \t", pos + name.size() + 1);
+            size_t end = request.find("\r\n", pos);
+            if (start == std::string::npos || start > end) return "";
+            return request.substr(start, end - start);
+        }
+    }
+    return "";
+}
+
+// Proxy WebSocket → VNC dentro del proceso, en su propio hilo con un
+// EventLoop. Sirve los ficheros de noVNC por HTTP y convierte cada conexión
+// WebSocket en una conexión TCP al servidor VNC de QEMU. Cada conexión tiene
+// sus buffers fijos: reenviar una trama no reserva memoria
+class WebSocketProxy {
+public:
+    struct Options {
+        int port;
+        std::string webRoot;
+        std::string vncSocket; // socket UNIX de QEMU; si está vacío, vncHost:vncPort
+        std::string vncHost;
+        int vncPort;
+        bool splice = true; // VNC → cliente por splice() a través de una tubería
+        bool adaptive = true; // reescribir SetEncodings según RTT y ritmo de vaciado
+        bool broadcast = false; // una sola sesión VNC repartida entre todos los visores
+    };
+
+private:
+    static constexpr size_t bufferSize = 64 * 1024;
+    static constexpr size_t headerRoom = 10; // cabecera máxima de una trama del servidor
+    static constexpr size_t maxEncodings = 64;
+    static constexpr uint64_t maxCutText = 1 << 20;
+
+    // Formato de píxel de la difusión, el que pide noVNC: 32 bpp, profundidad
+    // 24, little-endian, color verdadero, R/G/B en los bytes 0/1/2
+    static constexpr unsigned char pixelFormat[16] = {32, 24, 0, 1, 0, 255, 0, 255, 0, 255, 0, 8, 16, 0, 0, 0};
+
+    // Codificaciones por orden de preferencia, calidad JPEG de Tight (0-9) y
+    // nivel de compresión (0-9) de cada perfil de enlace
+    struct EncodingTier {
+        const char* name;
+        int32_t encodings[4];
+        int quality;
+        int compression;
+    };
+    static constexpr EncodingTier tiers[] = {
+        {"lan", {1, 16, 5, 0}, 9, 1},  // CopyRect, ZRLE, Hextile, Raw
+        {"wan", {1, 7, 16, 0}, 6, 6},  // CopyRect, Tight, ZRLE, Raw
+        {"slow", {1, 7, 16, 0}, 2, 9}, // igual que wan con JPEG agresivo
+    };
+
+    struct Connection {
+        enum State { ReadingRequest, SendingFile, Relaying };
+
+        int client;
+        int server;
+        State state;
+        bool connecting;
+        bool closing; // cerrar en cuanto se vacíe lo pendiente hacia el cliente
+        uint32_t clientEvents;
+        uint32_t serverEvents;
+
+        // HTTP: petición y fichero estático en curso
+        std::string request;
+        std::string responseHead;
+        size_t responseSent;
+        int fileFd;
+        off_t fileOffset;
+        off_t fileSize;
+
+        // Cliente → VNC: tramas enmascaradas y carga ya desenmascarada. Hasta
+        // toServerReady hay mensajes RFB completos que ya se pueden enviar
+        unsigned char fromClient[bufferSize];
+        size_t fromClientSize;
+        unsigned char toServer[bufferSize];
+        size_t toServerStart;
+        size_t toServerReady;
+        size_t toServerEnd;
+        bool inFrame;
+        int opcode;
+        uint64_t frameRemaining;
+        unsigned char mask[4];
+        size_t maskIndex;
+        unsigned char control[125];
+        size_t controlSize;
+
+        // VNC → cliente: se lee detrás de headerRoom y la cabecera va delante.
+        // Con splice sólo la cabecera pasa por toClient y la carga espera en
+        // la tubería (pipePending bytes) sin copiarse a espacio de usuario
+        unsigned char toClient[headerRoom + bufferSize];
+        size_t toClientStart;
+        size_t toClientEnd;
+        int pipeRead;
+        int pipeWrite;
+        size_t pipePending;
+        unsigned char controlOut[2 * (2 + 125)];
+        size_t controlOutStart;
+        size_t controlOutEnd;
+
+        // Mensajes RFB del cliente; Opaque deja de interpretarlos
+        enum Phase { RFBVersion, RFBSecurity, RFBAuth, RFBInit, RFBMessages, Opaque };
+        uint64_t id;
+        Phase phase;
+        uint64_t passthrough; // resto de un ClientCutText que no hace falta mirar
+        int32_t encodings[maxEncodings];
+        size_t encodingCount;
+        bool haveEncodings;
+        int tier;
+        int candidateTier;
+        int stableTicks;
+
+        // Medidas: RTT por ping/pong, ritmo al que se vacía la cola de envío
+        // del socket del cliente y peticiones de actualización por segundo
+        double rttMs;
+        bool pingOutstanding;
+        Clock::time_point pingSent;
+        uint64_t sentBytes; // escritos al cliente desde el último tick
+        int queuedBytes;    // en la cola de envío en el último tick
+        double drainRate;   // bytes/s, negativo hasta tener una medida
+        uint64_t updateRequests;
+        double fps;
+
+        // Modo difusión: el proxy hace de servidor RFB para el visor y le
+        // manda en Raw la caja sucia de la copia del framebuffer
+        enum ViewerPhase { ViewerVersion, ViewerSecurity, ViewerInit, ViewerWaiting, ViewerReady };
+        bool viewer;
+        ViewerPhase viewerPhase;
+        int viewerMinor; // versión RFB 3.x del visor
+        bool desktopSize; // admite la pseudo-codificación DesktopSize
+        bool resizePending;
+        bool wantsUpdate;
+        int dirtyX1, dirtyY1, dirtyX2, dirtyY2; // vacía si dirtyX2 <= dirtyX1
+        bool sendingUpdate;
+        int sendX, sendY, sendW, sendH;
+        uint64_t sendOffset; // bytes de píxeles del rectángulo ya en toClient
+        bool forwardText; // el ClientCutText en curso es del controlador
+        std::string cutText; // ClientCutText del controlador, entero antes de reenviarlo
+
+        Connection()
+            : client(-1), server(-1), state(ReadingRequest), connecting(false), closing(false), clientEvents(0),
+              serverEvents(0), responseSent(0), fileFd(-1), fileOffset(0), fileSize(0), fromClientSize(0),
+              toServerStart(0), toServerReady(0), toServerEnd(0), inFrame(false), opcode(0), frameRemaining(0),
+              maskIndex(0), controlSize(0), toClientStart(0), toClientEnd(0), pipeRead(-1), pipeWrite(-1),
+              pipePending(0), controlOutStart(0), controlOutEnd(0), id(0), phase(Opaque), passthrough(0),
+              encodingCount(0), haveEncodings(false), tier(1), candidateTier(1), stableTicks(0), rttMs(-1),
+              pingOutstanding(false), sentBytes(0), queuedBytes(0), drainRate(-1), updateRequests(0), fps(0),
+              viewer(false), viewerPhase(ViewerVersion), viewerMinor(8), desktopSize(false), resizePending(false),
+              wantsUpdate(false), dirtyX1(0), dirtyY1(0), dirtyX2(0), dirtyY2(0), sendingUpdate(false), sendX(0),
+              sendY(0), sendW(0), sendH(0), sendOffset(0), forwardText(false) {}
+    };
+
+    // Modo difusión: una sola conexión RFB con QEMU, siempre en Raw, y la
+    // copia del framebuffer que se reparte a los visores
+    struct Upstream {
+        enum Phase { Version, Security, SecurityResult, ServerInit, Messages };
+
+        int fd = -1;
+        bool connecting = false;
+        bool ready = false; // ServerInit recibido: ya hay framebuffer
+        Phase phase = Version;
+        uint32_t events = 0;
+        unsigned char in[bufferSize];
+        size_t inSize = 0;
+        std::vector<unsigned char> out; // handshake, peticiones y entrada del controlador
+        size_t outStart = 0;
+        int width = 0;
+        int height = 0;
+        std::string name;
+        std::vector<unsigned char> framebuffer;
+        int rectsLeft = 0;
+        bool inRect = false;
+        int rectX = 0, rectY = 0, rectW = 0, rectH = 0;
+        uint64_t rectOffset = 0;
+        uint64_t skip = 0; // resto de un ServerCutText
+    };
+
+    Options options;
+    EventLoop loop;
+    int listenFd;
+    int wakeFd;
+    int tickFd;
+    Clock::time_point lastTick;
+    std::thread worker;
+    std::unordered_map<int, std::unique_ptr<Connection>> connections;
+    Upstream upstream;
+    bool upstreamBusy; // dentro de onUpstream: no se puede cerrar todavía
+    Connection* controller; // único visor cuya entrada llega a QEMU
+
+    std::atomic<uint64_t> accepted;
+    std::atomic<uint64_t> sessions;
+    std::atomic<uint64_t> active;
+    std::atomic<uint64_t> bytesToServer;
+    std::atomic<uint64_t> bytesToClient;
+    std::atomic<uint64_t> framesToClient;
+    std::atomic<uint64_t> splicedFrames;
+    std::atomic<uint64_t> copiedToClient; // bytes VNC → cliente que pasaron por espacio de usuario
+    std::atomic<uint64_t> tierChanges;
+    std::atomic<uint64_t> upstreamUpdates;
+    std::atomic<uint64_t> controllerId;
+    std::atomic<int> framebufferWidth;
+    std::atomic<int> framebufferHeight;
+    mutable std::mutex viewersMutex;
+    std::string viewers; // medidas por sesión, rehechas en cada tick
+
+    static bool wouldBlock() {
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+
+    void closeConnection(Connection* c) {
+        if (c->state == Connection::Relaying && --active == 0) armTick(false);
+        if (c == controller) electController(c);
+        if (c->viewer) releaseUpstream(c);
+        for (int fd : {c->client, c->server}) {
+            if (fd < 0) continue;
+            loop.remove(fd);
+            close(fd);
+        }
+        closePipe(c);
+        if (c->fileFd >= 0) close(c->fileFd);
+        connections.erase(c->client);
+    }
+
+    // Sólo toca epoll cuando cambia lo que interesa de cada socket
+    void updateInterest(Connection* c) {
+        uint32_t clientEvents = 0;
+        bool clientPending =
+            c->toClientStart < c->toClientEnd || c->pipePending > 0 || c->controlOutStart < c->controlOutEnd;
+        if (c->state == Connection::SendingFile || clientPending) clientEvents |= EPOLLOUT;
+        if (c->state == Connection::ReadingRequest ||
+            (c->state == Connection::Relaying && !c->closing && c->fromClientSize < bufferSize)) {
+            clientEvents |= EPOLLIN;
+        }
+        if (clientEvents != c->clientEvents) {
+            loop.modify(c->client, clientEvents);
+            c->clientEvents = clientEvents;
+        }
+        if (c->server < 0) return;
+
+        uint32_t serverEvents = 0;
+        if (c->connecting || c->toServerStart < c->toServerReady) serverEvents |= EPOLLOUT;
+        if (!c->connecting && !c->closing && !clientPending) serverEvents |= EPOLLIN;
+        if (serverEvents != c->serverEvents) {
+            loop.modify(c->server, serverEvents);
+            c->serverEvents = serverEvents;
+        }
+    }
+
+    void onAccept() {
+        while (true) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return;
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            auto connection = std::make_unique<Connection>();
+            Connection* c = connection.get();
+            c->client = fd;
+            c->clientEvents = EPOLLIN;
+            connections[fd] = std::move(connection);
+            loop.add(fd, EPOLLIN, [this, c](uint32_t events) { onClient(c, events); });
+            accepted++;
+        }
+    }
+
+    void onClient(Connection* c, uint32_t events) {
+        if (c->state == Connection::ReadingRequest) {
+            readRequest(c);
+            return;
+        }
+        if (c->state == Connection::SendingFile) {
+            sendFile(c);
+            return;
+        }
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            closeConnection(c);
+            return;
+        }
+        if (c->viewer) {
+            onViewer(c, events);
+            return;
+        }
+        if (events & EPOLLOUT) {
+            if (!flushClient(c)) return;
+        }
+        if ((events & EPOLLIN) && !c->closing) {
+            ssize_t n = recv(c->client, c->fromClient + c->fromClientSize, bufferSize - c->fromClientSize, 0);
+            if (n == 0 || (n < 0 && !wouldBlock() && errno != EINTR)) {
+                closeConnection(c);
+                return;
+            }
+            if (n > 0) c->fromClientSize += n;
+            if (!parseFrames(c)) {
+                closeConnection(c);
+                return;
+            }
+            if (!c->connecting && !flushServer(c)) return;
+            if (!flushClient(c)) return;
+        }
+        updateInterest(c);
+    }
+
+    void onServer(Connection* c, uint32_t events) {
+        if (c->connecting) {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            getsockopt(c->server, SOL_SOCKET, SO_ERROR, &error, &length);
+            if (error != 0) {
+                sendClose(c, 1011);
+                if (flushClient(c)) updateInterest(c);
+                return;
+            }
+            c->connecting = false;
+        }
+        if ((events & EPOLLOUT) && !flushServer(c)) return;
+        if (c->server >= 0 && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+            // Sólo se lee con todo lo anterior ya entregado al cliente
+            if (c->toClientStart == c->toClientEnd && c->pipePending == 0 && c->controlOutStart == c->controlOutEnd) {
+                bool spliced = false;
+                ssize_t n = readServer(c, spliced);
+                if (n == 0 || (n < 0 && !wouldBlock() && errno != EINTR)) {
+                    sendClose(c, 1000);
+                } else if (n > 0) {
+                    frameServerData(c, static_cast<size_t>(n), spliced);
+                }
+            } else if (events & (EPOLLHUP | EPOLLERR)) {
+                sendClose(c, 1000);
+            }
+        }
+        if (flushClient(c)) updateInterest(c);
+    }
+
+    void closePipe(Connection* c) {
+        for (int* fd : {&c->pipeRead, &c->pipeWrite}) {
+            if (*fd >= 0) close(*fd);
+            *fd = -1;
+        }
+    }
+
+    // Lee del servidor a la tubería o, sin ella, a toClient. Si el socket no
+    // admite splice la conexión pasa al buffer para siempre
+    ssize_t readServer(Connection* c, bool& spliced) {
+        if (c->pipeWrite >= 0) {
+            ssize_t n = splice(c->server, nullptr, c->pipeWrite, nullptr, bufferSize, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n >= 0 || errno != EINVAL) {
+                spliced = true;
+                return n;
+            }
+            closePipe(c);
+        }
+        return recv(c->server, c->toClient + headerRoom, bufferSize, 0);
+    }
+
+    // Cabecera de trama binaria sin máscara justo delante de toClient + headerRoom
+    static size_t frameHeader(Connection* c, size_t size) {
+        size_t header = size < 126 ? 2 : (size < 65536 ? 4 : 10);
+        unsigned char* p = c->toClient + headerRoom - header;
+        p[0] = 0x82;
+        if (header == 2) {
+            p[1] = static_cast<unsigned char>(size);
+        } else if (header == 4) {
+            p[1] = 126;
+            p[2] = static_cast<unsigned char>(size >> 8);
+            p[3] = static_cast<unsigned char>(size);
+        } else {
+            p[1] = 127;
+            for (int i = 0; i < 8; i++) p[2 + i] = static_cast<unsigned char>(uint64_t(size) >> (56 - 8 * i));
+        }
+        c->toClientStart = headerRoom - header;
+        return header;
+    }
+
+    // Trama binaria sin máscara delante de los datos recién leídos; con
+    // splice la carga sigue en la tubería y sólo se escribe la cabecera
+    void frameServerData(Connection* c, size_t size, bool spliced) {
+        size_t header = frameHeader(c, size);
+        c->toClientEnd = headerRoom + (spliced ? 0 : size);
+        c->pipePending = spliced ? size : 0;
+        bytesToClient += size;
+        framesToClient++;
+        if (spliced) splicedFrames++;
+        copiedToClient += header + (spliced ? 0 : size);
+    }
+
+    // Extrae tramas de fromClient: datos desenmascarados a toServer, control aparte
+    bool parseFrames(Connection* c) {
+        size_t pos = 0;
+        const unsigned char* in = c->fromClient;
+        while (pos < c->fromClientSize) {
+            if (!c->inFrame) {
+                size_t available = c->fromClientSize - pos;
+                if (available < 2) break;
+                uint64_t length = in[pos + 1] & 0x7f;
+                size_t header = 2;
+                if (length == 126) {
+                    if (available < 4) break;
+                    length = (uint64_t(in[pos + 2]) << 8) | in[pos + 3];
+                    header = 4;
+                } else if (length == 127) {
+                    if (available < 10) break;
+                    length = 0;
+                    for (int i = 0; i < 8; i++) length = (length << 8) | in[pos + 2 + i];
+                    header = 10;
+                }
+                if (!(in[pos + 1] & 0x80)) return false; // el cliente siempre enmascara
+                if (available < header + 4) break;
+                c->opcode = in[pos] & 0x0f;
+                if (c->opcode >= 8 && (length > 125 || !(in[pos] & 0x80))) return false;
+                std::memcpy(c->mask, in + pos + header, 4);
+                c->frameRemaining = length;
+                c->maskIndex = 0;
+                c->controlSize = 0;
+                c->inFrame = true;
+                pos += header + 4;
+            }
+
+            size_t chunk = static_cast<size_t>(std::min<uint64_t>(c->fromClientSize - pos, c->frameRemaining));
+            unsigned char* out;
+            if (c->opcode < 8) {
+                compactToServer(c);
+                chunk = std::min(chunk, bufferSize - c->toServerEnd);
+                out = c->toServer + c->toServerEnd;
+                c->toServerEnd += chunk;
+                bytesToServer += chunk;
+            } else {
+                out = c->control + c->controlSize;
+                c->controlSize += chunk;
+            }
+            for (size_t i = 0; i < chunk; i++) out[i] = in[pos + i] ^ c->mask[(c->maskIndex + i) & 3];
+            c->maskIndex += chunk;
+            c->frameRemaining -= chunk;
+            pos += chunk;
+
+            if (c->frameRemaining > 0) {
+                if (chunk == 0) break; // toServer lleno
+                continue;
+            }
+            c->inFrame = false;
+            if (c->opcode == 8) {
+                sendClose(c, 1000);
+                return true;
+            }
+            if (c->opcode == 9) queueControl(c, 0x8a, c->control, c->controlSize);
+            if (c->opcode == 10 && c->pingOutstanding) {
+                double sample = std::chrono::duration<double, std::milli>(Clock::now() - c->pingSent).count();
+                c->rttMs = c->rttMs < 0 ? sample : 0.7 * c->rttMs + 0.3 * sample;
+                c->pingOutstanding = false;
+            }
+        }
+        std::memmove(c->fromClient, c->fromClient + pos, c->fromClientSize - pos);
+        c->fromClientSize -= pos;
+        scanMessages(c);
+        return true;
+    }
+
+    // Lo ya enviado deja sitio: un mensaje a medias pasa al principio
+    static void compactToServer(Connection* c) {
+        if (c->toServerStart == 0 || c->toServerStart != c->toServerReady) return;
+        std::memmove(c->toServer, c->toServer + c->toServerStart, c->toServerEnd - c->toServerStart);
+        c->toServerEnd -= c->toServerStart;
+        c->toServerReady = c->toServerStart = 0;
+    }
+
+    static uint32_t readBE(const unsigned char* p, int bytes) {
+        uint32_t v = 0;
+        for (int i = 0; i < bytes; i++) v = (v << 8) | p[i];
+        return v;
+    }
+
+    // Avanza toServerReady mensaje a mensaje. Sólo hace falta conocer la
+    // longitud de cada uno; SetEncodings se reescribe y las peticiones de
+    // actualización se cuentan. Lo que no se reconoce pasa sin tocar
+    void scanMessages(Connection* c) {
+        while (c->toServerReady < c->toServerEnd) {
+            size_t available = c->toServerEnd - c->toServerReady;
+            if (c->phase == Connection::Opaque) {
+                c->toServerReady = c->toServerEnd;
+                return;
+            }
+            if (c->passthrough > 0) {
+                size_t take = static_cast<size_t>(std::min<uint64_t>(c->passthrough, available));
+                c->toServerReady += take;
+                c->passthrough -= take;
+                continue;
+            }
+
+            const unsigned char* m = c->toServer + c->toServerReady;
+            bool message = c->phase == Connection::RFBMessages;
+            size_t need = 1;
+            Connection::Phase next = c->phase;
+            switch (c->phase) {
+            case Connection::RFBVersion:
+                // 3.3 no dice al cliente qué seguridad eligió el servidor
+                need = 12;
+                if (available < need) return;
+                next = std::memcmp(m, "RFB 003.00", 10) == 0 && m[10] >= '7' ? Connection::RFBSecurity
+                                                                               : Connection::Opaque;
+                break;
+            case Connection::RFBSecurity:
+                next = m[0] == 1 ? Connection::RFBInit : (m[0] == 2 ? Connection::RFBAuth : Connection::Opaque);
+                break;
+            case Connection::RFBAuth:
+                need = 16;
+                next = Connection::RFBInit;
+                break;
+            case Connection::RFBInit:
+                next = Connection::RFBMessages;
+                break;
+            default:
+                need = messageLength(m, available);
+                break;
+            }
+            if (need == SIZE_MAX) return;
+            if (need == 0 || need > bufferSize) {
+                c->phase = Connection::Opaque;
+                continue;
+            }
+            if (available < need) return;
+            c->phase = next;
+
+            if (message && m[0] == 2) {
+                need = rewriteEncodings(c, c->toServerReady, need);
+            } else if (message && m[0] == 3) {
+                c->updateRequests++;
+            } else if (message && m[0] == 6) {
+                // ClientCutText: la cabecera basta, el texto pasa tal cual
+                int32_t length = static_cast<int32_t>(readBE(m + 4, 4));
+                c->passthrough = length < 0 ? -int64_t(length) : length;
+            }
+            c->toServerReady += need;
+        }
+    }
+
+    // Longitud de un mensaje cliente → servidor; SIZE_MAX si aún falta
+    // cabecera y 0 si el tipo no se conoce
+    static size_t messageLength(const unsigned char* m, size_t available) {
+        switch (m[0]) {
+        case 0: return 20;                                                     // SetPixelFormat
+        case 2: return available < 4 ? SIZE_MAX : 4 + 4 * readBE(m + 2, 2);   // SetEncodings
+        case 3: return 10;                                                     // FramebufferUpdateRequest
+        case 4: return 8;                                                      // KeyEvent
+        case 5: return 6;                                                      // PointerEvent
+        case 6: return 8;                                                      // ClientCutText (cabecera)
+        case 150: return 10;                                                   // EnableContinuousUpdates
+        case 248: return available < 9 ? SIZE_MAX : 9 + m[8];                  // ClientFence
+        case 250: return 4;                                                    // xvp
+        case 251: return available < 8 ? SIZE_MAX : 8 + 16 * size_t(m[6]);    // SetDesktopSize
+        case 255:                                                              // mensajes de QEMU
+            if (available < 2) return SIZE_MAX;
+            if (m[1] == 0) return 12;
+            if (m[1] == 1) return available < 4 ? SIZE_MAX : (readBE(m + 2, 2) == 2 ? 10 : 4);
+            return 0;
+        default: return 0;
+        }
+    }
+
+    // Lista del perfil: sus codificaciones que el cliente admite, las
+    // pseudo-codificaciones del cliente salvo calidad y compresión, y las de
+    // calidad y compresión del perfil
+    static size_t tierEncodings(const Connection* c, int tier, int32_t* out) {
+        auto listed = [c](int32_t encoding) {
+            return encoding == 0 || std::find(c->encodings, c->encodings + c->encodingCount, encoding) !=
+                                        c->encodings + c->encodingCount;
+        };
+        auto tuning = [](int32_t e) {
+            return (e >= -32 && e <= -23) || (e >= -256 && e <= -247) || (e >= -512 && e <= -412) ||
+                   (e >= -768 && e <= -763);
+        };
+        size_t count = 0;
+        for (int32_t encoding : tiers[tier].encodings) {
+            if (listed(encoding)) out[count++] = encoding;
+        }
+        for (size_t i = 0; i < c->encodingCount; i++) {
+            if (c->encodings[i] < 0 && !tuning(c->encodings[i])) out[count++] = c->encodings[i];
+        }
+        out[count++] = -32 + tiers[tier].quality;
+        out[count++] = -256 + tiers[tier].compression;
+        return count;
+    }
+
+    static void writeEncodings(unsigned char* p, const int32_t* encodings, size_t count) {
+        p[0] = 2;
+        p[1] = 0;
+        p[2] = static_cast<unsigned char>(count >> 8);
+        p[3] = static_cast<unsigned char>(count);
+        for (size_t i = 0; i < count; i++) {
+            uint32_t v = static_cast<uint32_t>(encodings[i]);
+            for (int j = 0; j < 4; j++) p[4 + 4 * i + j] = static_cast<unsigned char>(v >> (24 - 8 * j));
+        }
+    }
+
+    // Guarda lo que pidió el cliente y lo cambia por la lista del perfil
+    // actual; devuelve la nueva longitud del mensaje
+    size_t rewriteEncodings(Connection* c, size_t pos, size_t length) {
+        if (!options.adaptive) return length;
+        const unsigned char* m = c->toServer + pos;
+        c->encodingCount = std::min<size_t>(readBE(m + 2, 2), maxEncodings);
+        for (size_t i = 0; i < c->encodingCount; i++) c->encodings[i] = static_cast<int32_t>(readBE(m + 4 + 4 * i, 4));
+        c->haveEncodings = true;
+
+        int32_t encodings[maxEncodings + 6];
+        size_t count = tierEncodings(c, c->tier, encodings);
+        size_t rewritten = 4 + 4 * count;
+        if (c->toServerEnd - length + rewritten > bufferSize) return length;
+        std::memmove(c->toServer + pos + rewritten, c->toServer + pos + length, c->toServerEnd - pos - length);
+        c->toServerEnd = c->toServerEnd - length + rewritten;
+        writeEncodings(c->toServer + pos, encodings, count);
+        return rewritten;
+    }
+
+    // Inserta un SetEncodings del perfil nuevo en el primer límite de mensaje.
+    // Sólo se conoce mientras se siguen los mensajes y no se está dentro del
+    // texto de un ClientCutText
+    bool injectEncodings(Connection* c) {
+        if (c->phase != Connection::RFBMessages || c->passthrough > 0) return false;
+        int32_t encodings[maxEncodings + 6];
+        size_t count = tierEncodings(c, c->tier, encodings);
+        size_t size = 4 + 4 * count;
+        compactToServer(c);
+        if (c->toServerEnd + size > bufferSize) return false;
+        size_t pos = c->toServerReady;
+        std::memmove(c->toServer + pos + size, c->toServer + pos, c->toServerEnd - pos);
+        writeEncodings(c->toServer + pos, encodings, count);
+        c->toServerReady += size;
+        c->toServerEnd += size;
+        return true;
+    }
+
+    bool flushServer(Connection* c) {
+        if (c->server < 0) return true;
+        while (c->toServerStart < c->toServerReady) {
+            ssize_t n = send(c->server, c->toServer + c->toServerStart, c->toServerReady - c->toServerStart,
+                             MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && wouldBlock()) return true;
+            if (n <= 0) {
+                sendClose(c, 1011);
+                return true;
+            }
+            c->toServerStart += n;
+        }
+        // Con sitio otra vez en toServer se procesa lo que esperaba en fromClient
+        if (c->fromClientSize > 0 && !parseFrames(c)) {
+            closeConnection(c);
+            return false;
+        }
+        return true;
+    }
+
+    // Primero la trama en curso (cabecera y carga en la tubería), luego el
+    // control pendiente
+    bool flushClient(Connection* c) {
+        for (auto* region : {&c->toClientStart, &c->controlOutStart}) {
+            unsigned char* data = region == &c->toClientStart ? c->toClient : c->controlOut;
+            size_t end = region == &c->toClientStart ? c->toClientEnd : c->controlOutEnd;
+            int flags = MSG_NOSIGNAL | (region == &c->toClientStart && c->pipePending > 0 ? MSG_MORE : 0);
+            while (*region < end) {
+                ssize_t n = send(c->client, data + *region, end - *region, flags);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0 && wouldBlock()) return true;
+                if (n <= 0) {
+                    closeConnection(c);
+                    return false;
+                }
+                *region += n;
+                c->sentBytes += n;
+            }
+            while (region == &c->toClientStart && c->pipePending > 0) {
+                ssize_t n = splice(c->pipeRead, nullptr, c->client, nullptr, c->pipePending,
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0 && wouldBlock()) return true;
+                if (n <= 0) {
+                    closeConnection(c);
+                    return false;
+                }
+                c->pipePending -= n;
+                c->sentBytes += n;
+            }
+        }
+        if (c->closing) {
+            closeConnection(c);
+            return false;
+        }
+        return true;
+    }
+
+    // Encola una trama de control completa; si no cabe (ráfaga de pings) se descarta
+    static void queueControl(Connection* c, unsigned char opcode, const unsigned char* payload, size_t size) {
+        if (c->controlOutStart == c->controlOutEnd) c->controlOutStart = c->controlOutEnd = 0;
+        if (c->controlOutEnd + 2 + size > sizeof(c->controlOut)) return;
+        c->controlOut[c->controlOutEnd] = opcode;
+        c->controlOut[c->controlOutEnd + 1] = static_cast<unsigned char>(size);
+        if (size > 0) std::memcpy(c->controlOut + c->controlOutEnd + 2, payload, size);
+        c->controlOutEnd += 2 + size;
+    }
+
+    // Encola el cierre al cliente y suelta el servidor; la conexión termina
+    // cuando flushClient vacía lo pendiente
+    void sendClose(Connection* c, int code) {
+        if (c->closing) return;
+        unsigned char payload[2] = {static_cast<unsigned char>(code >> 8), static_cast<unsigned char>(code)};
+        queueControl(c, 0x88, payload, sizeof(payload));
+        c->closing = true;
+        c->fromClientSize = 0;
+        c->toServerStart = c->toServerReady = c->toServerEnd = 0;
+        if (c->server >= 0) {
+            loop.remove(c->server);
+            close(c->server);
+            c->server = -1;
+        }
+    }
+
+    void readRequest(Connection* c) {
+        char buf[4096];
+        ssize_t n = recv(c->client, buf, sizeof(buf), 0);
+        if (n == 0 || (n < 0 && !wouldBlock() && errno != EINTR)) {
+            closeConnection(c);
+            return;
+        }
+        if (n > 0) c->request.append(buf, n);
+        size_t end = c->request.find("\r\n\r\n");
+        if (end == std::string::npos) {
+            if (c->request.size() > 16384) closeConnection(c);
+            return;
+        }
+
+        std::istringstream line(c->request.substr(0, c->request.find("\r\n")));
+        std::string method, target;
+        line >> method >> target;
+        std::string head = c->request.substr(0, end + 2);
+        if (method == "GET" && strcasecmp(httpHeader(head, "Upgrade").c_str(), "websocket") == 0) {
+            upgrade(c, head, c->request.substr(end + 4));
+        } else {
+            serveFile(c, method, target);
+        }
+    }
+
+    void upgrade(Connection* c, const std::string& head, const std::string& rest) {
+        std::string key = httpHeader(head, "Sec-WebSocket-Key");
+        if (key.empty() || rest.size() > bufferSize) {
+            respond(c, "400 Bad Request");
+            return;
+        }
+        std::string response = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                               "Sec-WebSocket-Accept: " + webSocketAccept(key) + "\r\n";
+        // noVNC antiguo pide el subprotocolo "binary"
+        if (httpHeader(head, "Sec-WebSocket-Protocol").find("binary") != std::string::npos) {
+            response += "Sec-WebSocket-Protocol: binary\r\n";
+        }
+        response += "\r\n";
+
+        if (options.broadcast ? !connectUpstream() : (c->server = connectVNC()) < 0) {
+            respond(c, "502 Bad Gateway");
+            return;
+        }
+        if (!options.broadcast) {
+            c->connecting = true;
+            c->serverEvents = EPOLLOUT;
+            int fds[2];
+            if (options.splice && pipe2(fds, O_NONBLOCK | O_CLOEXEC) == 0) {
+                c->pipeRead = fds[0];
+                c->pipeWrite = fds[1];
+            }
+            loop.add(c->server, EPOLLOUT, [this, c](uint32_t events) { onServer(c, events); });
+        }
+
+        std::memcpy(c->toClient, response.data(), response.size());
+        c->toClientStart = 0;
+        c->toClientEnd = response.size();
+        std::memcpy(c->fromClient, rest.data(), rest.size());
+        c->fromClientSize = rest.size();
+        c->request.clear();
+        c->request.shrink_to_fit();
+        c->state = Connection::Relaying;
+        c->id = ++sessions;
+        if (active++ == 0) armTick(true);
+
+        // Perfil inicial con el RTT del handshake TCP, hasta que haya pings
+        c->phase = options.adaptive ? Connection::RFBVersion : Connection::Opaque;
+        tcp_info info;
+        socklen_t length = sizeof(info);
+        if (getsockopt(c->client, IPPROTO_TCP, TCP_INFO, &info, &length) == 0) c->rttMs = info.tcpi_rtt / 1000.0;
+        c->tier = c->candidateTier = chooseTier(c);
+
+        if (options.broadcast) {
+            c->viewer = true;
+            c->phase = Connection::Opaque;
+            queueBinary(c, reinterpret_cast<const unsigned char*>("RFB 003.008\n"), 12);
+            if (!readViewer(c)) {
+                closeConnection(c);
+                return;
+            }
+            pumpViewer(c);
+            return;
+        }
+        if (!parseFrames(c)) {
+            closeConnection(c);
+            return;
+        }
+        if (flushClient(c)) updateInterest(c);
+    }
+
+    static int chooseTier(const Connection* c) {
+        double mbps = c->drainRate / (1 << 20);
+        if (c->rttMs > 150 || (c->drainRate >= 0 && mbps < 1)) return 2;
+        if (c->rttMs > 20 || (c->drainRate >= 0 && mbps < 20)) return 1;
+        return 0;
+    }
+
+    // El tick sólo corre con sesiones abiertas: sin visores el proceso no se despierta
+    void armTick(bool enabled) {
+        itimerspec spec = {};
+        if (enabled) {
+            spec.it_interval.tv_sec = 1;
+            spec.it_value.tv_sec = 1;
+            lastTick = Clock::now();
+        }
+        timerfd_settime(tickFd, 0, &spec, nullptr);
+        if (!enabled) {
+            std::lock_guard<std::mutex> lock(viewersMutex);
+            viewers.clear();
+        }
+    }
+
+    // Cada segundo: FPS y ritmo de vaciado de la ventana, perfil con
+    // histéresis de tres ticks, un ping nuevo y la foto de las medidas
+    void onTick() {
+        uint64_t expirations;
+        if (read(tickFd, &expirations, sizeof(expirations)) < 0) {}
+        auto now = Clock::now();
+        double elapsed = std::max(std::chrono::duration<double>(now - lastTick).count(), 0.001);
+        lastTick = now;
+
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(1);
+        for (auto it = connections.begin(); it != connections.end();) {
+            Connection* c = it->second.get();
+            ++it;
+            if (c->state != Connection::Relaying || c->closing) continue;
+
+            c->fps = c->updateRequests / elapsed;
+            c->updateRequests = 0;
+            // Lo entregado es lo escrito menos lo que creció la cola de envío.
+            // Sólo mide el enlace si la cola siguió llena todo el tick; si no,
+            // el cliente pidió poco y la medida sólo sirve para subir
+            int queued = 0;
+            ioctl(c->client, TIOCOUTQ, &queued);
+            double delivered = double(c->sentBytes) - (queued - c->queuedBytes);
+            bool saturated = queued >= 64 * 1024 && c->queuedBytes >= 64 * 1024;
+            c->sentBytes = 0;
+            c->queuedBytes = queued;
+            double sample = delivered / elapsed;
+            if (delivered > 0 && (saturated || sample > c->drainRate)) {
+                c->drainRate = c->drainRate < 0 || !saturated ? sample : 0.7 * c->drainRate + 0.3 * sample;
+            }
+            if (c->pingOutstanding) {
+                c->rttMs = std::max(c->rttMs, std::chrono::duration<double, std::milli>(now - c->pingSent).count());
+            }
+
+            // En difusión todos reciben Raw del framebuffer: no hay perfil que
+            // ajustar; en Opaque ya no se sabe dónde empieza cada mensaje
+            int target = c->viewer || c->phase == Connection::Opaque ? c->tier : chooseTier(c);
+            if (target != c->candidateTier) {
+                c->candidateTier = target;
+                c->stableTicks = 0;
+            } else if (target != c->tier && ++c->stableTicks >= 3) {
+                int previous = c->tier;
+                c->tier = target;
+                if (!c->haveEncodings || injectEncodings(c)) {
+                    tierChanges++;
+                } else {
+                    c->tier = previous; // sin sitio en toServer: se reintenta en el siguiente tick
+                }
+            }
+
+            const EncodingTier& tier = tiers[c->tier];
+            out << " viewer" << c->id << "=tier:" << tier.name << ",quality:" << tier.quality
+                << ",compression:" << tier.compression << ",rtt_ms:" << c->rttMs << ",drain_mbps:";
+            if (c->drainRate < 0) {
+                out << "-";
+            } else {
+                out << c->drainRate / (1 << 20);
+            }
+            out << ",fps:" << c->fps;
+            if (c->viewer) out << ",role:" << (c == controller ? "controller" : "watcher");
+
+            if (!c->pingOutstanding) {
+                queueControl(c, 0x89, nullptr, 0);
+                c->pingSent = now;
+                c->pingOutstanding = true;
+            }
+            if (!flushServer(c)) continue;
+            if (flushClient(c)) updateInterest(c);
+        }
+        std::lock_guard<std::mutex> lock(viewersMutex);
+        viewers = out.str();
+    }
+
+    // Conexión no bloqueante al VNC; por socket UNIX no pasa por la pila TCP
+    int connectVNC() {
+        bool local = !options.vncSocket.empty();
+        int fd = socket(local ? AF_UNIX : AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        int result;
+        if (local) {
+            sockaddr_un addr = {};
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, options.vncSocket.c_str(), sizeof(addr.sun_path) - 1);
+            result = connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        } else {
+            sockaddr_in addr = {};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(static_cast<uint16_t>(options.vncPort));
+            inet_pton(AF_INET, options.vncHost.c_str(), &addr.sin_addr);
+            result = connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        if (result != 0 && errno != EINPROGRESS) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // Trama binaria completa al final de toClient, para los mensajes cortos
+    // que el proxy genera como servidor RFB
+    static bool queueBinary(Connection* c, const unsigned char* data, size_t size) {
+        if (c->toClientStart == c->toClientEnd) c->toClientStart = c->toClientEnd = 0;
+        size_t header = size < 126 ? 2 : 4;
+        if (size >= 65536 || c->toClientEnd + header + size > sizeof(c->toClient)) return false;
+        unsigned char* p = c->toClient + c->toClientEnd;
+        p[0] = 0x82;
+        if (header == 2) {
+            p[1] = static_cast<unsigned char>(size);
+        } else {
+            p[1] = 126;
+            p[2] = static_cast<unsigned char>(size >> 8);
+            p[3] = static_cast<unsigned char>(size);
+        }
+        std::memcpy(p + header, data, size);
+        c->toClientEnd += header + size;
+        return true;
+    }
+
+    static void writeBE(unsigned char* p, uint32_t value, int bytes) {
+        for (int i = 0; i < bytes; i++) p[i] = static_cast<unsigned char>(value >> (8 * (bytes - 1 - i)));
+    }
+
+    void onViewer(Connection* c, uint32_t events) {
+        if ((events & EPOLLIN) && !c->closing) {
+            ssize_t n = recv(c->client, c->fromClient + c->fromClientSize, bufferSize - c->fromClientSize, 0);
+            if (n == 0 || (n < 0 && !wouldBlock() && errno != EINTR)) {
+                closeConnection(c);
+                return;
+            }
+            if (n > 0) c->fromClientSize += n;
+            if (!readViewer(c)) {
+                closeConnection(c);
+                return;
+            }
+        }
+        pumpViewer(c);
+    }
+
+    // Desenmascara y atiende mensajes hasta agotar lo recibido; toServer
+    // hace aquí de buffer de entrada del servidor RFB del proxy
+    bool readViewer(Connection* c) {
+        while (true) {
+            size_t pending = c->fromClientSize;
+            if (!parseFrames(c)) return false;
+            if (c->closing) return true;
+            if (!processViewer(c)) return false;
+            if (c->fromClientSize == 0 || c->fromClientSize == pending) return true;
+        }
+    }
+
+    bool processViewer(Connection* c) {
+        while (c->toServerStart < c->toServerEnd) {
+            size_t available = c->toServerEnd - c->toServerStart;
+            const unsigned char* m = c->toServer + c->toServerStart;
+            if (c->passthrough > 0) {
+                size_t take = static_cast<size_t>(std::min<uint64_t>(c->passthrough, available));
+                if (c->forwardText) c->cutText.append(reinterpret_cast<const char*>(m), take);
+                c->passthrough -= take;
+                c->toServerStart += take;
+                if (c->passthrough == 0 && c->forwardText) {
+                    upstreamWrite(reinterpret_cast<const unsigned char*>(c->cutText.data()), c->cutText.size());
+                    c->cutText.clear();
+                    c->cutText.shrink_to_fit();
+                    c->forwardText = false;
+                }
+                continue;
+            }
+
+            size_t need = 1;
+            if (c->viewerPhase == Connection::ViewerVersion) {
+                need = 12;
+                if (available < need) break;
+                if (std::memcmp(m, "RFB 003.", 8) != 0) return false;
+                int minor = std::atoi(std::string(reinterpret_cast<const char*>(m) + 8, 3).c_str());
+                c->viewerMinor = minor >= 8 ? 8 : (minor >= 7 ? 7 : 3);
+                if (c->viewerMinor == 3) {
+                    // 3.3: el servidor impone la seguridad "None"
+                    const unsigned char none[4] = {0, 0, 0, 1};
+                    queueBinary(c, none, sizeof(none));
+                    c->viewerPhase = Connection::ViewerInit;
+                } else {
+                    const unsigned char types[2] = {1, 1};
+                    queueBinary(c, types, sizeof(types));
+                    c->viewerPhase = Connection::ViewerSecurity;
+                }
+            } else if (c->viewerPhase == Connection::ViewerSecurity) {
+                if (m[0] != 1) return false;
+                if (c->viewerMinor == 8) {
+                    const unsigned char ok[4] = {0, 0, 0, 0};
+                    queueBinary(c, ok, sizeof(ok));
+                }
+                c->viewerPhase = Connection::ViewerInit;
+            } else if (c->viewerPhase == Connection::ViewerInit) {
+                c->viewerPhase = Connection::ViewerWaiting;
+                if (upstream.ready) sendServerInit(c);
+            } else if (c->viewerPhase == Connection::ViewerWaiting) {
+                break; // nada más hasta recibir ServerInit
+            } else {
+                need = messageLength(m, available);
+                if (need == SIZE_MAX) break;
+                if (need == 0 || need > bufferSize) return false;
+                if (available < need) break;
+                if (!handleViewerMessage(c, m, need)) return false;
+            }
+            c->toServerStart += need;
+        }
+        std::memmove(c->toServer, c->toServer + c->toServerStart, c->toServerEnd - c->toServerStart);
+        c->toServerEnd -= c->toServerStart;
+        c->toServerReady = c->toServerEnd;
+        c->toServerStart = 0;
+        return true;
+    }
+
+    // La entrada (teclado, ratón, portapapeles) sólo pasa del controlador
+    bool handleViewerMessage(Connection* c, const unsigned char* m, size_t size) {
+        bool control = c == controller;
+        switch (m[0]) {
+        case 0:
+            // Sólo se difunde un formato; convertir por visor costaría lo que se ahorra
+            return std::memcmp(m + 4, pixelFormat, 13) == 0;
+        case 2:
+            for (size_t i = 0; i < readBE(m + 2, 2); i++) {
+                if (static_cast<int32_t>(readBE(m + 4 + 4 * i, 4)) == -223) c->desktopSize = true;
+            }
+            break;
+        case 3:
+            c->updateRequests++;
+            c->wantsUpdate = true;
+            if (!m[1]) markDirty(c, readBE(m + 2, 2), readBE(m + 4, 2), readBE(m + 6, 2), readBE(m + 8, 2));
+            break;
+        case 4:
+        case 5:
+        case 255:
+            if (control) upstreamWrite(m, size);
+            break;
+        case 6: {
+            // Se reúne entero antes de mandarlo: si el controlador se fuera a
+            // mitad, QEMU leería su siguiente entrada como texto. Los muy
+            // grandes no pasan
+            int32_t length = static_cast<int32_t>(readBE(m + 4, 4));
+            c->passthrough = length < 0 ? -int64_t(length) : length;
+            c->forwardText = control && c->passthrough <= maxCutText;
+            if (!c->forwardText) break;
+            c->cutText.assign(reinterpret_cast<const char*>(m), size);
+            if (c->passthrough == 0) {
+                upstreamWrite(m, size);
+                c->forwardText = false;
+            }
+            break;
+        }
+        default:
+            break; // el proxy no anuncia fences, actualizaciones continuas ni SetDesktopSize
+        }
+        return true;
+    }
+
+    void sendServerInit(Connection* c) {
+        unsigned char init[24 + 255];
+        size_t nameLength = std::min<size_t>(upstream.name.size(), 255);
+        writeBE(init, upstream.width, 2);
+        writeBE(init + 2, upstream.height, 2);
+        std::memcpy(init + 4, pixelFormat, sizeof(pixelFormat));
+        writeBE(init + 20, static_cast<uint32_t>(nameLength), 4);
+        std::memcpy(init + 24, upstream.name.data(), nameLength);
+        queueBinary(c, init, 24 + nameLength);
+        c->viewerPhase = Connection::ViewerReady;
+        // Un visor nuevo empieza con la pantalla entera
+        markDirty(c, 0, 0, upstream.width, upstream.height);
+        if (!controller) {
+            controller = c;
+            controllerId = c->id;
+        }
+    }
+
+    // El control pasa al visor más antiguo que siga conectado
+    void electController(Connection* leaving) {
+        controller = nullptr;
+        for (auto& entry : connections) {
+            Connection* c = entry.second.get();
+            if (c == leaving || !c->viewer || c->viewerPhase != Connection::ViewerReady) continue;
+            if (!controller || c->id < controller->id) controller = c;
+        }
+        controllerId = controller ? controller->id : 0;
+    }
+
+    void markDirty(Connection* c, int x, int y, int w, int h) {
+        int x2 = std::min(x + w, upstream.width);
+        int y2 = std::min(y + h, upstream.height);
+        if (x >= x2 || y >= y2) return;
+        if (c->dirtyX2 <= c->dirtyX1) {
+            c->dirtyX1 = x;
+            c->dirtyY1 = y;
+            c->dirtyX2 = x2;
+            c->dirtyY2 = y2;
+            return;
+        }
+        c->dirtyX1 = std::min(c->dirtyX1, x);
+        c->dirtyY1 = std::min(c->dirtyY1, y);
+        c->dirtyX2 = std::max(c->dirtyX2, x2);
+        c->dirtyY2 = std::max(c->dirtyY2, y2);
+    }
+
+    // Siguiente trama para el visor: un cambio de tamaño pendiente o el
+    // rectángulo Raw de su caja sucia, copiado del framebuffer a trozos de
+    // hasta bufferSize. Un rectángulo empezado se termina aunque la pantalla
+    // cambie; lo que cambie queda en la caja sucia para la siguiente
+    bool fillViewer(Connection* c) {
+        if (c->viewerPhase != Connection::ViewerReady || !upstream.ready) return false;
+        if (c->toClientStart != c->toClientEnd) return false;
+        unsigned char* payload = c->toClient + headerRoom;
+        size_t size = 0;
+        if (!c->sendingUpdate) {
+            if (!c->wantsUpdate) return false;
+            if (c->resizePending) {
+                c->resizePending = false;
+                unsigned char update[16] = {0, 0, 0, 1, 0, 0, 0, 0};
+                writeBE(update + 8, upstream.width, 2);
+                writeBE(update + 10, upstream.height, 2);
+                writeBE(update + 12, static_cast<uint32_t>(-223), 4);
+                std::memcpy(payload, update, sizeof(update));
+                c->toClientEnd = headerRoom + sizeof(update);
+                frameHeader(c, sizeof(update));
+                c->wantsUpdate = false;
+                return true;
+            }
+            if (c->dirtyX2 <= c->dirtyX1) return false;
+            c->sendX = c->dirtyX1;
+            c->sendY = c->dirtyY1;
+            c->sendW = c->dirtyX2 - c->dirtyX1;
+            c->sendH = c->dirtyY2 - c->dirtyY1;
+            c->dirtyX1 = c->dirtyY1 = c->dirtyX2 = c->dirtyY2 = 0;
+            c->wantsUpdate = false;
+            c->sendingUpdate = true;
+            c->sendOffset = 0;
+            payload[0] = 0;
+            payload[1] = 0;
+            writeBE(payload + 2, 1, 2);
+            writeBE(payload + 4, c->sendX, 2);
+            writeBE(payload + 6, c->sendY, 2);
+            writeBE(payload + 8, c->sendW, 2);
+            writeBE(payload + 10, c->sendH, 2);
+            writeBE(payload + 12, 0, 4);
+            size = 16;
+        }
+
+        uint64_t rowBytes = uint64_t(c->sendW) * 4;
+        uint64_t total = rowBytes * c->sendH;
+        while (size < bufferSize && c->sendOffset < total) {
+            uint64_t row = c->sendOffset / rowBytes;
+            uint64_t column = c->sendOffset % rowBytes;
+            size_t chunk = static_cast<size_t>(std::min<uint64_t>(rowBytes - column, bufferSize - size));
+            int y = c->sendY + static_cast<int>(row);
+            if (y < upstream.height && (c->sendX + c->sendW) <= upstream.width) {
+                std::memcpy(payload + size,
+                            upstream.framebuffer.data() + (uint64_t(y) * upstream.width + c->sendX) * 4 + column,
+                            chunk);
+            } else {
+                std::memset(payload + size, 0, chunk); // la pantalla encogió a mitad de envío
+            }
+            size += chunk;
+            c->sendOffset += chunk;
+        }
+        if (c->sendOffset >= total) c->sendingUpdate = false;
+        c->toClientEnd = headerRoom + size;
+        size_t header = frameHeader(c, size);
+        bytesToClient += size;
+        framesToClient++;
+        copiedToClient += header + size;
+        return true;
+    }
+
+    bool pumpViewer(Connection* c) {
+        do {
+            if (!flushClient(c)) return false;
+            if (c->toClientStart < c->toClientEnd || c->controlOutStart < c->controlOutEnd) break;
+        } while (fillViewer(c));
+        updateInterest(c);
+        return true;
+    }
+
+    // Recorre los visores listos; el callback puede cerrar el visor actual
+    template <typename Function>
+    void forEachViewer(Function function) {
+        for (auto it = connections.begin(); it != connections.end();) {
+            Connection* c = it->second.get();
+            ++it;
+            if (c->viewer && c->viewerPhase == Connection::ViewerReady && !c->closing) function(c);
+        }
+    }
+
+    bool connectUpstream() {
+        if (upstream.fd >= 0) return true;
+        int fd = connectVNC();
+        if (fd < 0) return false;
+        upstream.fd = fd;
+        upstream.connecting = true;
+        upstream.ready = false;
+        upstream.phase = Upstream::Version;
+        upstream.inSize = 0;
+        upstream.out.clear();
+        upstream.outStart = 0;
+        upstream.rectsLeft = 0;
+        upstream.inRect = false;
+        upstream.skip = 0;
+        upstream.events = EPOLLOUT;
+        loop.add(fd, EPOLLOUT, [this](uint32_t events) { onUpstream(events); });
+        return true;
+    }
+
+    void closeUpstream() {
+        loop.remove(upstream.fd);
+        close(upstream.fd);
+        upstream.fd = -1;
+        upstream.ready = false;
+    }
+
+    bool hasViewers(const Connection* leaving = nullptr) const {
+        for (const auto& entry : connections) {
+            if (entry.second->viewer && entry.second.get() != leaving) return true;
+        }
+        return false;
+    }
+
+    // Sin visores no se sigue pidiendo ni copiando pantalla a QEMU; el
+    // siguiente upgrade vuelve a conectar. Dentro de onUpstream se espera
+    // a que termine el mensaje en curso
+    void releaseUpstream(const Connection* leaving) {
+        if (upstream.fd < 0 || upstreamBusy || hasViewers(leaving)) return;
+        closeUpstream();
+    }
+
+    // Sin sesión con QEMU no queda nada que enseñar: se cierran los visores
+    void failUpstream() {
+        closeUpstream();
+        for (auto it = connections.begin(); it != connections.end();) {
+            Connection* c = it->second.get();
+            ++it;
+            if (!c->viewer || c->closing) continue;
+            sendClose(c, 1011);
+            if (flushClient(c)) updateInterest(c);
+        }
+    }
+
+    void upstreamWrite(const unsigned char* data, size_t size) {
+        if (upstream.fd < 0) return;
+        if (upstream.outStart == upstream.out.size()) {
+            upstream.out.clear();
+            upstream.outStart = 0;
+        }
+        upstream.out.insert(upstream.out.end(), data, data + size);
+        updateUpstreamInterest();
+    }
+
+    void updateUpstreamInterest() {
+        uint32_t events = EPOLLIN;
+        if (upstream.connecting || upstream.outStart < upstream.out.size()) events |= EPOLLOUT;
+        if (events != upstream.events) {
+            loop.modify(upstream.fd, events);
+            upstream.events = events;
+        }
+    }
+
+    void onUpstream(uint32_t events) {
+        upstreamBusy = true;
+        handleUpstream(events);
+        upstreamBusy = false;
+        if (upstream.fd < 0) return;
+        if (hasViewers()) {
+            updateUpstreamInterest();
+        } else {
+            closeUpstream();
+        }
+    }
+
+    void handleUpstream(uint32_t events) {
+        if (upstream.connecting) {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            getsockopt(upstream.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+            if (error != 0) {
+                failUpstream();
+                return;
+            }
+            upstream.connecting = false;
+        }
+        while (upstream.outStart < upstream.out.size()) {
+            ssize_t n = send(upstream.fd, upstream.out.data() + upstream.outStart,
+                             upstream.out.size() - upstream.outStart, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && wouldBlock()) break;
+            if (n <= 0) {
+                failUpstream();
+                return;
+            }
+            upstream.outStart += n;
+        }
+        if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            ssize_t n = recv(upstream.fd, upstream.in + upstream.inSize, bufferSize - upstream.inSize, 0);
+            if (n == 0 || (n < 0 && !wouldBlock() && errno != EINTR) || (n > 0 && !parseUpstream(n))) {
+                failUpstream();
+                return;
+            }
+        }
+    }
+
+    void requestUpdate(bool incremental) {
+        unsigned char request[10] = {3, static_cast<unsigned char>(incremental), 0, 0, 0, 0};
+        writeBE(request + 6, upstream.width, 2);
+        writeBE(request + 8, upstream.height, 2);
+        upstreamWrite(request, sizeof(request));
+    }
+
+    void resizeFramebuffer(int width, int height) {
+        upstream.width = width;
+        upstream.height = height;
+        upstream.framebuffer.assign(size_t(width) * height * 4, 0);
+        framebufferWidth = width;
+        framebufferHeight = height;
+    }
+
+    // Tras cada FramebufferUpdate se pide el siguiente y se despierta a los
+    // visores que esperan
+    void finishUpdate() {
+        upstreamUpdates++;
+        requestUpdate(true);
+        forEachViewer([this](Connection* c) { pumpViewer(c); });
+    }
+
+    // Cliente RFB del proxy: handshake, ServerInit y FramebufferUpdate en Raw
+    // copiado a la caja del framebuffer según llega
+    bool parseUpstream(size_t received) {
+        upstream.inSize += received;
+        size_t pos = 0;
+        while (pos < upstream.inSize) {
+            const unsigned char* m = upstream.in + pos;
+            size_t available = upstream.inSize - pos;
+            if (upstream.skip > 0) {
+                size_t take = static_cast<size_t>(std::min<uint64_t>(upstream.skip, available));
+                upstream.skip -= take;
+                pos += take;
+                continue;
+            }
+            if (upstream.inRect) {
+                uint64_t rowBytes = uint64_t(upstream.rectW) * 4;
+                uint64_t row = upstream.rectOffset / rowBytes;
+                uint64_t column = upstream.rectOffset % rowBytes;
+                size_t chunk = static_cast<size_t>(std::min<uint64_t>(available, rowBytes - column));
+                std::memcpy(upstream.framebuffer.data() +
+                                (uint64_t(upstream.rectY + row) * upstream.width + upstream.rectX) * 4 + column,
+                            m, chunk);
+                upstream.rectOffset += chunk;
+                pos += chunk;
+                if (upstream.rectOffset == rowBytes * upstream.rectH) finishRect();
+                continue;
+            }
+
+            size_t need = 1;
+            if (upstream.phase == Upstream::Version) {
+                need = 12;
+                if (available < need) break;
+                upstreamWrite(reinterpret_cast<const unsigned char*>("RFB 003.008\n"), 12);
+                upstream.phase = Upstream::Security;
+            } else if (upstream.phase == Upstream::Security) {
+                need = 1 + m[0];
+                if (m[0] == 0) return false; // sin tipos: sigue el motivo del rechazo
+                if (available < need) break;
+                if (std::find(m + 1, m + need, 1) == m + need) return false; // QEMU pide contraseña
+                const unsigned char none = 1;
+                upstreamWrite(&none, 1);
+                upstream.phase = Upstream::SecurityResult;
+            } else if (upstream.phase == Upstream::SecurityResult) {
+                need = 4;
+                if (available < need) break;
+                if (readBE(m, 4) != 0) return false;
+                const unsigned char shared = 1;
+                upstreamWrite(&shared, 1);
+                upstream.phase = Upstream::ServerInit;
+            } else if (upstream.phase == Upstream::ServerInit) {
+                if (available < 24) break;
+                need = 24 + readBE(m + 20, 4);
+                if (need > bufferSize) return false;
+                if (available < need) break;
+                resizeFramebuffer(readBE(m, 2), readBE(m + 2, 2));
+                upstream.name.assign(reinterpret_cast<const char*>(m) + 24, need - 24);
+
+                // Siempre Raw en el formato de la difusión, más DesktopSize
+                unsigned char setup[20 + 12] = {0};
+                std::memcpy(setup + 4, pixelFormat, sizeof(pixelFormat));
+                setup[20] = 2;
+                writeBE(setup + 22, 2, 2);
+                writeBE(setup + 24, 0, 4);
+                writeBE(setup + 28, static_cast<uint32_t>(-223), 4);
+                upstreamWrite(setup, sizeof(setup));
+                requestUpdate(false);
+                upstream.phase = Upstream::Messages;
+                upstream.ready = true;
+                for (auto& entry : connections) {
+                    Connection* c = entry.second.get();
+                    if (c->viewer && c->viewerPhase == Connection::ViewerWaiting) sendServerInit(c);
+                }
+                forEachViewer([this](Connection* c) {
+                    if (processViewer(c)) {
+                        pumpViewer(c);
+                    } else {
+                        closeConnection(c);
+                    }
+                });
+            } else if (upstream.rectsLeft > 0) {
+                need = 12;
+                if (available < need) break;
+                int x = readBE(m, 2), y = readBE(m + 2, 2), w = readBE(m + 4, 2), h = readBE(m + 6, 2);
+                int32_t encoding = static_cast<int32_t>(readBE(m + 8, 4));
+                if (encoding == -223) {
+                    resizeFramebuffer(w, h);
+                    forEachViewer([this](Connection* c) {
+                        // Sin DesktopSize el visor no puede seguir el tamaño nuevo
+                        if (!c->desktopSize) {
+                            sendClose(c, 1003);
+                            if (flushClient(c)) updateInterest(c);
+                            return;
+                        }
+                        c->resizePending = true;
+                        c->wantsUpdate = true;
+                        markDirty(c, 0, 0, upstream.width, upstream.height);
+                    });
+                    upstream.rectsLeft--;
+                    if (upstream.rectsLeft == 0) finishUpdate();
+                } else if (encoding == 0 && x + w <= upstream.width && y + h <= upstream.height) {
+                    upstream.rectX = x;
+                    upstream.rectY = y;
+                    upstream.rectW = w;
+                    upstream.rectH = h;
+                    upstream.rectOffset = 0;
+                    upstream.inRect = w > 0 && h > 0;
+                    if (!upstream.inRect) finishRect();
+                } else {
+                    return false;
+                }
+            } else if (m[0] == 0) {
+                need = 4;
+                if (available < need) break;
+                upstream.rectsLeft = readBE(m + 2, 2);
+                if (upstream.rectsLeft == 0) finishUpdate();
+            } else if (m[0] == 1) {
+                // SetColourMapEntries no se usa con color verdadero, pero se salta
+                need = 6;
+                if (available < need) break;
+                need += 6 * readBE(m + 4, 2);
+                if (need > bufferSize) return false;
+                if (available < need) break;
+            } else if (m[0] == 2) {
+                need = 1; // Bell
+            } else if (m[0] == 3) {
+                need = 8;
+                if (available < need) break;
+                upstream.skip = readBE(m + 4, 4);
+            } else {
+                return false;
+            }
+            pos += need;
+        }
+        std::memmove(upstream.in, upstream.in + pos, upstream.inSize - pos);
+        upstream.inSize -= pos;
+        return true;
+    }
+
+    void finishRect() {
+        upstream.inRect = false;
+        forEachViewer([this](Connection* c) {
+            markDirty(c, upstream.rectX, upstream.rectY, upstream.rectW, upstream.rectH);
+        });
+        upstream.rectsLeft--;
+        if (upstream.rectsLeft == 0) finishUpdate();
+    }
+
+    void serveFile(Connection* c, const std::string& method, std::string target) {
+        static const std::map<std::string, std::string> types = {
+            {".html", "text/html"}, {".js", "application/javascript"}, {".css", "text/css"},
+            {".json", "application/json"}, {".svg", "image/svg+xml"}, {".png", "image/png"},
+            {".ico", "image/x-icon"}, {".woff", "font/woff"}, {".woff2", "font/woff2"},
+        };
+        if (method != "GET" && method != "HEAD") {
+            respond(c, "405 Method Not Allowed");
+            return;
+        }
+        target = target.substr(0, target.find_first_of("?#"));
+        if (target.empty() || target[0] != '/' || target.find("..") != std::string::npos) {
+            respond(c, "400 Bad Request");
+            return;
+        }
+        if (target == "/") target = "/vnc.html";
+
+        std::string path = options.webRoot + target;
+        c->fileFd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (c->fileFd < 0 || fstat(c->fileFd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            respond(c, "404 Not Found");
+            return;
+        }
+        auto type = types.find(fs::path(path).extension().string());
+        c->fileSize = method == "HEAD" ? 0 : st.st_size;
+        c->responseHead = "HTTP/1.1 200 OK\r\nContent-Type: " +
+                          (type == types.end() ? std::string("application/octet-stream") : type->second) +
+                          "\r\nContent-Length: " + std::to_string(st.st_size) + "\r\nConnection: close\r\n\r\n";
+        c->state = Connection::SendingFile;
+        sendFile(c);
+    }
+
+    void respond(Connection* c, const std::string& status) {
+        if (c->fileFd >= 0) {
+            close(c->fileFd);
+            c->fileFd = -1;
+        }
+        c->fileSize = 0;
+        c->responseHead = "HTTP/1.1 " + status + "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        c->state = Connection::SendingFile;
+        sendFile(c);
+    }
+
+    void sendFile(Connection* c) {
+        while (c->responseSent < c->responseHead.size()) {
+            ssize_t n = send(c->client, c->responseHead.data() + c->responseSent,
+                             c->responseHead.size() - c->responseSent, MSG_NOSIGNAL);
+            if (n < 0 && wouldBlock()) {
+                updateInterest(c);
+                return;
+            }
+            if (n <= 0) {
+                closeConnection(c);
+                return;
+            }
+            c->responseSent += n;
+        }
+        while (c->fileOffset < c->fileSize) {
+            ssize_t n = sendfile(c->client, c->fileFd, &c->fileOffset, c->fileSize - c->fileOffset);
+            if (n < 0 && wouldBlock()) {
+                updateInterest(c);
+                return;
+            }
+            if (n <= 0) break;
+        }
+        closeConnection(c);
+    }
+
+public:
+    WebSocketProxy()
+        : listenFd(-1), wakeFd(-1), tickFd(-1), upstreamBusy(false), controller(nullptr), accepted(0), sessions(0),
+          active(0), bytesToServer(0), bytesToClient(0), framesToClient(0), splicedFrames(0), copiedToClient(0), tierChanges(0),
+          upstreamUpdates(0), controllerId(0), framebufferWidth(0), framebufferHeight(0) {}
+    ~WebSocketProxy() { stop(); }
+
+    WebSocketProxy(const WebSocketProxy&) = delete;
+    WebSocketProxy& operator=(const WebSocketProxy&) = delete;
+
+    // El puerto queda escuchando antes de volver; el bucle corre en otro hilo
+    bool start(const Options& proxyOptions, std::string& error) {
+        options = proxyOptions;
+        listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int one = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(static_cast<uint16_t>(options.port));
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (listenFd < 0 || bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+            listen(listenFd, 128) != 0) {
+            error = std::strerror(errno);
+            stop();
+            return false;
+        }
+
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        tickFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        loop.add(listenFd, EPOLLIN, [this](uint32_t) { onAccept(); });
+        loop.add(wakeFd, EPOLLIN, [this](uint32_t) { loop.stop(); });
+        loop.add(tickFd, EPOLLIN, [this](uint32_t) { onTick(); });
+        worker = std::thread([this]() { loop.run(); });
+        return true;
+    }
+
+    void stop() {
+        if (worker.joinable()) {
+            uint64_t one = 1;
+            if (write(wakeFd, &one, sizeof(one)) < 0) {}
+            worker.join();
+        }
+        while (!connections.empty()) closeConnection(connections.begin()->second.get());
+        for (int* fd : {&upstream.fd, &listenFd, &wakeFd, &tickFd}) {
+            if (*fd < 0) continue;
+            loop.remove(*fd);
+            close(*fd);
+            *fd = -1;
+        }
+    }
+
+    bool running() const { return worker.joinable(); }
+
+    double copiedPerFrame() const {
+        uint64_t frames = framesToClient.load();
+        return frames ? double(copiedToClient.load()) / frames : 0.0;
+    }
+
+    // "connections=4 sessions=1 ... tier_changes=0 viewer1=tier:lan,quality:9,compression:1,rtt_ms:0.1,..."
+    // con una entrada viewerN por sesión abierta; en difusión añade
+    // "broadcast=1024x768 updates=N controller=viewerK" y el rol de cada visor
+    std::string summary() const {
+        std::ostringstream out;
+        out << "connections=" << accepted.load() << " sessions=" << sessions.load() << " active=" << active.load()
+            << " to_server=" << bytesToServer.load() << " to_client=" << bytesToClient.load() << " frames=" << framesToClient.load()
+            << " spliced=" << splicedFrames.load() << " copied_per_frame=" << std::fixed << std::setprecision(1)
+            << copiedPerFrame() << " tier_changes=" << tierChanges.load();
+        if (options.broadcast) {
+            out << " broadcast=" << framebufferWidth.load() << "x" << framebufferHeight.load()
+                << " updates=" << upstreamUpdates.load() << " controller=";
+            if (controllerId.load()) {
+                out << "viewer" << controllerId.load();
+            } else {
+                out << "-";
+            }
+        }
+        std::lock_guard<std::mutex> lock(viewersMutex);
+        out << viewers;
+        return out.str();
+    }
+};
+
+class ComputerVM {
+private:
+    std::string diskPath;
+    std::string romPath;
+    std::string firmwarePath;
+    std::string noVNCPath;
+    std::string runPath;
+    std::string varsPath;
+    bool useVNC;
+    std::string vncTransport; // "unix" o "tcp"
+    int qemuTimeoutMs;
+    int proxyTimeoutMs;
+    int proxyPort;
+    bool proxySplice;
+    bool proxyAdaptive;
+    bool proxyBroadcast;
+    int shutdownTimeoutMs;
+    int suspendTimeoutMs;
+    std::string statePath;
+    bool resumeRequested;
+    std::string resumeFrom;
+    QEMUInstance machine;
+    WebSocketProxy proxy;
+    std::string diskProfile;
+    Qcow2Writer::Options diskOptions;
+    std::set<std::string> diskOverrides;
+    std::string cpuPolicy;
+    std::string memoryPolicy;
+    std::string machineProfile;
+    HostTopology host;
+    MachineSize size;
+    std::string pinPolicy;
+    std::string emulatorCPUList;
+    PinPlan pinPlan;
+    std::string numaPolicy;
+    NUMALayout numa;
+    std::string hugePagePolicy;
+    std::string hugePagePath;
+    uint64_t hugePageSize;
+    int hugePageGuests; // máquinas que comparten las páginas de hugetlbfs (el tamaño del pool)
+    bool memoryPrealloc;
+    bool preallocRequested; // --prealloc on: tocar toda la RAM al arrancar
+    int preallocThreads;
+    int ioThreads;
+    std::string diskCache;
+    std::string diskAIO;
+    bool diskDirect;
+    std::string accelPolicy;
+    std::string accelerator;
+    uint64_t tcgCacheSize;
+    std::string ephemeralMode; // vacío, "discard" o "commit"
+    std::mutex firmwareMutex; // NVRAM del firmware, compartida por los lanzamientos del pool
+    int commitTimeoutMs;
+    std::mutex logMutex;
+    BootTimeline timeline;
+    std::string tracePath;
+    bool diskOk;
+    std::string isoFile;
+    bool interrupted; // llegó SIGINT/SIGTERM/SIGHUP durante el arranque
+
+public:
+    ComputerVM() {
+        diskPath = "./devices/disk/disk.qcow2";
+        romPath = "./devices/rom";
+        firmwarePath = "./boot/firmware/OVMF_CODE.fd";
+        noVNCPath = "./libraries/noVNC";
+        runPath = "./devices/run";
+        varsPath = "./boot/firmware/OVMF_VARS.fd";
+        machine.qmpSocketPath = runPath + "/qmp.sock";
+        machine.logPath = runPath + "/qemu.log";
+        machine.varsPath = varsPath;
+        machine.vncSocketPath = runPath + "/vnc.sock";
+        useVNC = true;
+        vncTransport = "unix";
+        qemuTimeoutMs = 10000;
+        proxyTimeoutMs = 5000;
+        proxyPort = 8080;
+        proxySplice = true;
+        proxyAdaptive = true;
+        proxyBroadcast = false;
+        shutdownTimeoutMs = 30000;
+        suspendTimeoutMs = 120000;
+        statePath = "./devices/state/machine.state";
+        resumeRequested = false;
+        diskProfile = "default";
+        diskOptions = {20ULL << 30, 16};
+        cpuPolicy = "4";
+        memoryPolicy = "4G";
+        numaPolicy = "auto";
+        hugePagePolicy = "thp";
+        hugePageSize = 0;
+        hugePageGuests = 1;
+        memoryPrealloc = false;
+        preallocRequested = false;
+        preallocThreads = 1;
+        ioThreads = 0;
+        diskCache = "none";
+        diskAIO = "threads";
+        diskDirect = false;
+        commitTimeoutMs = 600000;
+        accelPolicy = "auto";
+        accelerator = "kvm";
+        tcgCacheSize = 0;
+        diskOk = false;
+        interrupted = false;
+    }
+
+    void printLog(const std::string& level, const std::string& message) {
+        std::lock_guard<std::mutex> lock(logMutex);
+        std::cout << "[" << level << "] " << message << std::endl;
+    }
+
+    void printDebug(const std::string& message) {
+        std::lock_guard<std::mutex> lock(logMutex);
+        std::cout << "[DEBUG] " << message << std::endl;
+    }
+
+    bool checkFile(const std::string& path, const std::string& name) {
+        if (fs::exists(path)) {
+            printDebug(name + " available.. Yes!");
+            return true;
+        } else {
+            printDebug(name + " available.. No");
+            return false;
+        }
+    }
+
+    std::string findISO() {
+        printDebug("Checking for ISO files...");
+        try {
+            for (const auto& entry : fs::directory_iterator(romPath)) {
+                if (entry.path().extension() == ".iso") {
+                    return entry.path().string();
+                }
+            }
+        } catch (const fs::filesystem_error& e) {
+            printDebug("Error checking ROM directory: " + std::string(e.what()));
+        }
+        return "";
+    }
+
+    void createDirectories() {
+        try {
+            fs::create_directories("./devices/disk");
+            fs::create_directories("./devices/rom");
+            fs::create_directories("./boot/firmware");
+            fs::create_directories("./libraries");
+            fs::create_directories(runPath);
+            fs::create_directories(fs::path(statePath).parent_path());
+        } catch (const fs::filesystem_error& e) {
+            printLog("ERROR", "Failed to create directories: " + std::string(e.what()));
+        }
+    }
+
+    // Perfil con lo que se haya fijado por línea de órdenes encima; los
+    // overlays efímeros usan su perfil tal cual (applyOverrides = false)
+    bool resolveDiskOptions(const std::string& profile, Qcow2Writer::Options& options, bool applyOverrides = true) {
+        static const std::map<std::string, Qcow2Writer::Options> profiles = {
+            {"default", {20ULL << 30, 16, "off", false, false}},
+            // Sin asignar clusters ni actualizar refcounts en cada escritura
+            {"write-heavy", {20ULL << 30, 16, "metadata", true, false}},
+            // Además con los bloques ya reservados en el host
+            {"falloc", {20ULL << 30, 16, "falloc", true, false}},
+            // Clusters de 128K con subclusters de 4K: copy-on-write de 4K
+            {"overlay", {20ULL << 30, 17, "off", false, true}},
+        };
+        auto preset = profiles.find(profile);
+        if (preset == profiles.end()) {
+            printLog("ERROR", "Unknown disk profile: " + profile);
+            return false;
+        }
+        options = preset->second;
+        if (!applyOverrides) return true;
+        if (diskOverrides.count("size")) options.virtualSize = diskOptions.virtualSize;
+        if (diskOverrides.count("cluster_size")) options.clusterBits = diskOptions.clusterBits;
+        if (diskOverrides.count("preallocation")) options.preallocation = diskOptions.preallocation;
+        if (diskOverrides.count("lazy_refcounts")) options.lazyRefcounts = diskOptions.lazyRefcounts;
+        if (diskOverrides.count("extended_l2")) options.extendedL2 = diskOptions.extendedL2;
+        return true;
+    }
+
+    // El perfil se guarda junto a la imagen, en <imagen>.profile
+    static std::map<std::string, std::string> diskProfileValues(const std::string& profile,
+                                                                 const Qcow2Writer::Options& options) {
+        return {
+            {"profile", profile},
+            {"size", formatSize(options.virtualSize)},
+            {"cluster_size", formatSize(1ULL << options.clusterBits)},
+            {"preallocation", options.preallocation},
+            {"lazy_refcounts", options.lazyRefcounts ? "on" : "off"},
+            {"extended_l2", options.extendedL2 ? "on" : "off"},
+        };
+    }
+
+    std::string diskProfileSummary(const std::string& path) {
+        auto values = readKeyValueFile(path + ".profile");
+        if (values.empty()) return "no profile recorded";
+        std::string out;
+        for (const auto& entry : values) {
+            out += (out.empty() ? "" : " ") + entry.first + "=" + entry.second;
+        }
+        return out;
+    }
+
+    // --check-disk: contrasta el escritor de qcow2 con qemu-img. Crea la
+    // imagen con el perfil elegido si no existe y la comprueba con
+    // Qcow2Writer::verify y, si está instalado, con "qemu-img check"
+    int checkDiskImage(const std::string& path) {
+        std::string error;
+        if (!fs::exists(path)) {
+            Qcow2Writer::Options options;
+            if (!resolveDiskOptions(diskProfile, options)) return 1;
+            if (!Qcow2Writer::create(path, options, error)) {
+                printLog("ERROR", "Failed to create " + path + ": " + error);
+                return 1;
+            }
+            printLog("INFO", "Created " + path + " (" + diskProfile + " profile)");
+        }
+        if (!Qcow2Writer::verify(path, error)) {
+            printLog("ERROR", path + " is inconsistent: " + error);
+            return 1;
+        }
+        printLog("INFO", path + " passes Qcow2Writer::verify");
+        std::string qemuImg = findExecutable("qemu-img");
+        if (qemuImg.empty()) {
+            printLog("INFO", "qemu-img not found in PATH, skipping qemu-img check");
+            return 0;
+        }
+        std::string output;
+        if (!captureOutput({qemuImg, "check", "-q", "-f", "qcow2", path}, output, 30000)) {
+            while (!output.empty() && output.back() == '\n') output.pop_back();
+            printLog("ERROR", "qemu-img check failed: " + output);
+            return 1;
+        }
+        printLog("INFO", path + " passes qemu-img check");
+        return 0;
+    }
+
+    bool createDefaultDisk() {
+        if (!fs::exists(diskPath)) {
+            Qcow2Writer::Options options;
+            if (!resolveDiskOptions(diskProfile, options)) return false;
+            printLog("INFO", "Creating default " + formatSize(options.virtualSize) + " disk (" + diskProfile +
+                     " profile)...");
+            std::string error;
+            auto start = Clock::now();
+            bool created = Qcow2Writer::create(diskPath, options, error);
+            timeline.record("disk-create", "step", start);
+            if (created) {
+                if (!writeKeyValueFile(diskPath + ".profile", diskProfileValues(diskProfile, options))) {
+                    printLog("ERROR", "Failed to record disk profile " + diskPath + ".profile");
+                }
+                printLog("INFO", "Default disk created successfully!");
+                printDebug("Disk profile: " + diskProfileSummary(diskPath));
+                return true;
+            } else {
+                printLog("ERROR", "Failed to create default disk: " + error);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Objeto de memoria: hugetlbfs si hay páginas grandes, RAM anónima si no
+    std::string memoryBackend(const std::string& id, uint64_t bytes) {
+        std::string backend = hugePagePath.empty() ? "memory-backend-ram" : "memory-backend-file";
+        backend += ",id=" + id + ",size=" + std::to_string(bytes >> 20) + "M";
+        if (!hugePagePath.empty()) backend += ",mem-path=" + hugePagePath;
+        if (memoryPrealloc) backend += ",prealloc=on,prealloc-threads=" + std::to_string(preallocThreads);
+        return backend;
+    }
+
+    // Grafo de bloques de un disco qcow2: nodo "<node>-file" con la política
+    // de E/S y encima el nodo qcow2 "<node>". La caché L2 cubre la imagen
+    // entera para que las lecturas aleatorias no vuelvan a leer tablas L2, y
+    // cache-clean-interval libera las entradas que lleven 10 minutos sin uso.
+    // Mismo JSON para -blockdev y para blockdev-add. Un base de sólo lectura
+    // va por la caché de páginas del host, que así comparten todas las
+    // máquinas que arrancan sobre él
+    std::vector<std::string> diskBlockdevs(const std::string& path, const std::string& node,
+                                           const std::string& backing = "", bool readOnly = false) {
+        bool direct = diskDirect && !readOnly;
+        std::string aio = (!direct && diskAIO == "native") ? "threads" : diskAIO;
+        std::string cache = std::string("{\"direct\": ") + (direct ? "true" : "false") +
+                            ", \"no-flush\": " + (diskCache == "unsafe" ? "true" : "false") + "}";
+        std::string access = readOnly ? ", \"read-only\": true" : "";
+        std::string file = "{\"driver\": \"file\", \"node-name\": \"" + node + "-file\", \"filename\": \"" +
+                           jsonEscape(path) + "\", \"aio\": \"" + aio + "\", \"cache\": " + cache +
+                           ", \"discard\": \"unmap\"" + access + "}";
+        std::string qcow2 = "{\"driver\": \"qcow2\", \"node-name\": \"" + node + "\", \"file\": \"" + node +
+                            "-file\", \"cache\": " + cache + ", \"discard\": \"unmap\", \"detect-zeroes\": \"unmap\"" +
+                            access;
+        if (!backing.empty()) qcow2 += ", \"backing\": \"" + backing + "\"";
+        
+        Qcow2Header header;
+        std::string error;
+        if (Qcow2Header::read(path, header, error)) {
+            uint64_t clusterSize = 1ULL << header.clusterBits;
+            uint64_t l2Cache = std::max<uint64_t>((header.l2CoverageBytes() + clusterSize - 1) / clusterSize,
+                                                  1) * clusterSize;
+            uint64_t refcountCache = std::max<uint64_t>(l2Cache / 4, 4 * clusterSize);
+            qcow2 += ", \"l2-cache-size\": " + std::to_string(l2Cache) + ", \"refcount-cache-size\": " +
+                     std::to_string(refcountCache) + ", \"cache-clean-interval\": 600";
+        } else {
+            printLog("INFO", "Cannot read qcow2 header of " + path + " (" + error + "), using default caches");
+        }
+        return {file, qcow2 + "}"};
+    }
+
+    // Nodos del disco de una instancia: el disco directamente, o el base de
+    // sólo lectura ("base") con el overlay encima como "disk0"
+    std::vector<std::string> instanceBlockdevs(const std::string& disk, const std::string& overlay) {
+        if (overlay.empty()) return diskBlockdevs(disk, "disk0");
+        auto nodes = diskBlockdevs(disk, "base", "", true);
+        for (const auto& node : diskBlockdevs(overlay, "disk0", "base")) nodes.push_back(node);
+        return nodes;
+    }
+
+    // Overlay qcow2 vacío sobre el disco base, sin lanzar qemu-img: crear una
+    // máquina limpia cuesta lo mismo sea cual sea el tamaño del base
+    bool createOverlay(const std::string& base, const std::string& overlay, std::string& error) {
+        Qcow2Header header;
+        if (!Qcow2Header::read(base, header, error)) return false;
+        // Las opciones de --disk-* son del disco base; con ellas el perfil de
+        // overlay podría no ser válido (p.ej. subclusters con clusters de 4K)
+        Qcow2Writer::Options options;
+        if (!resolveDiskOptions("overlay", options, false)) {
+            error = "no overlay profile";
+            return false;
+        }
+        options.virtualSize = header.virtualSize;
+        options.backingFile = fs::absolute(base).lexically_normal().string();
+        
+        std::error_code ec;
+        if (fs::exists(overlay, ec)) {
+            printLog("INFO", "Discarding stale overlay " + overlay);
+            fs::remove(overlay, ec);
+        }
+        return Qcow2Writer::create(overlay, options, error);
+    }
+
+    bool commitsOverlay(const QEMUInstance& instance) const {
+        return &instance == &machine && ephemeralMode == "commit" && !instance.overlayPath.empty();
+    }
+
+    // block-commit activo con el invitado ya apagado: copia el overlay al
+    // base, espera a que estén sincronizados (BLOCK_JOB_READY) y cierra el job
+    bool commitOverlay(QEMUInstance& instance) {
+        QMPClient& qmp = instance.qmp;
+        auto start = Clock::now();
+        auto deadline = start + std::chrono::milliseconds(commitTimeoutMs);
+        std::string reply, data;
+        
+        printLog("INFO", "Committing overlay into " + diskPath + "...");
+        if (!qmp.execute("block-commit", reply, deadline,
+                         "{\"job-id\": \"commit0\", \"device\": \"disk0\", \"base-node\": \"base\"}")) {
+            printLog("ERROR", "block-commit failed: " + reply);
+            return false;
+        }
+        // Si el job falla antes de estar listo sólo llega BLOCK_JOB_COMPLETED
+        while (!qmp.waitEvent("BLOCK_JOB_READY", std::min(deadline, Clock::now() + std::chrono::milliseconds(100)))) {
+            if (qmp.waitEvent("BLOCK_JOB_COMPLETED", Clock::now(), &data) || remainingMs(deadline) == 0 ||
+                !qmp.isConnected()) {
+                printLog("ERROR", "Commit did not become ready: " +
+                         (data.empty() ? std::string("timeout") : jsonField(data, "error")));
+                return false;
+            }
+        }
+        if (!qmp.execute("job-complete", reply, deadline, "{\"id\": \"commit0\"}") ||
+            !qmp.waitEvent("BLOCK_JOB_COMPLETED", deadline, &data) || !jsonField(data, "error").empty()) {
+            printLog("ERROR", "Commit did not complete: " + (data.empty() ? reply : jsonField(data, "error")));
+            return false;
+        }
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count();
+        printLog("INFO", "Overlay committed (" + formatSize(std::stoull("0" + jsonField(data, "offset"))) +
+                 ") in " + std::to_string(ms) + " ms");
+        return true;
+    }
+
+    // Por defecto un solo IOThread, que vale en cualquier QEMU; repartir las
+    // colas entre varios (--iothreads N) necesita iothread-vq-mapping. Nunca
+    // más IOThreads que colas
+    int ioThreadCount() const {
+        int threads = ioThreads > 0 ? ioThreads : 1;
+        return std::min(threads, size.cpus);
+    }
+
+    // virtio-blk con una cola por vCPU repartidas entre los IOThreads. Va en
+    // JSON para que sirva igual en -device y en device_add; con varios
+    // IOThreads usa iothread-vq-mapping (QEMU 9.0 o posterior)
+    std::string diskDevice() const {
+        std::string device = "{\"driver\": \"virtio-blk-pci\", \"id\": \"disk0\", \"drive\": \"disk0\", "
+                             "\"num-queues\": " + std::to_string(size.cpus);
+        int threads = ioThreadCount();
+        if (threads == 1) {
+            device += ", \"iothread\": \"io0\"";
+        } else {
+            device += ", \"iothread-vq-mapping\": [";
+            for (int i = 0; i < threads; i++) {
+                device += std::string(i ? ", " : "") + "{\"iothread\": \"io" + std::to_string(i) + "\"}";
+            }
+            device += "]";
+        }
+        return device + "}";
+    }
+
+    std::vector<std::string> buildQEMUCommand(const QEMUInstance& instance) {
+        std::vector<std::string> cmd;
+        
+        cmd.push_back("qemu-system-x86_64");
+        
+        // Básicos: acelerador y tamaño calculados por planMachine() según el host
+        if (accelerator == "kvm") {
+            cmd.push_back("-accel");
+            cmd.push_back("kvm");
+            cmd.push_back("-cpu");
+            cmd.push_back("host,host-cache-info=on");
+        } else {
+            // "max" es todo lo que TCG sabe emular; no hay flags que traducir a mano
+            cmd.push_back("-accel");
+            cmd.push_back("tcg,thread=multi,tb-size=" + std::to_string(tcgCacheSize >> 20));
+            cmd.push_back("-cpu");
+            cmd.push_back("max");
+        }
+        cmd.push_back("-smp");
+        cmd.push_back(std::to_string(size.cpus) + ",sockets=" + std::to_string(size.sockets) + ",cores=" +
+                      std::to_string(size.cores) + ",threads=" + std::to_string(size.threads));
+        cmd.push_back("-m");
+        cmd.push_back(std::to_string(size.memory >> 20) + "M");
+        
+        // Memoria como backends ligados al nodo del host de sus vCPUs
+        for (size_t i = 0; i < numa.nodes.size(); i++) {
+            const auto& node = numa.nodes[i];
+            std::string id = "ram" + std::to_string(i);
+            std::string backend = memoryBackend(id, node.memory);
+            if (node.hostNode >= 0) {
+                backend += ",host-nodes=" + std::to_string(node.hostNode) + ",policy=bind";
+            }
+            cmd.push_back("-object");
+            cmd.push_back(backend);
+            
+            std::string guestNode = "node,nodeid=" + std::to_string(i) + ",memdev=" + id;
+            if (numa.nodes.size() > 1) {
+                std::stringstream ranges(formatCPUList(node.vcpus));
+                std::string range;
+                while (std::getline(ranges, range, ',')) guestNode += ",cpus=" + range;
+            }
+            cmd.push_back("-numa");
+            cmd.push_back(guestNode);
+        }
+        if (numa.nodes.empty() && (!hugePagePath.empty() || memoryPrealloc)) {
+            cmd.push_back("-object");
+            cmd.push_back(memoryBackend("ram0", size.memory));
+            cmd.push_back("-machine");
+            cmd.push_back("memory-backend=ram0");
+        }
+        
+        // VirtIO para mejor rendimiento
+        cmd.push_back("-vga");
+        cmd.push_back("virtio");
+        
+        // Configurar display según modo
+        if (useVNC) {
+            cmd.push_back("-display");
+            cmd.push_back("none");
+            cmd.push_back("-vnc");
+            cmd.push_back(vncAddress(instance));
+        } else {
+            cmd.push_back("-display");
+            cmd.push_back("gtk,full-screen=on");
+        }
+        
+        // UEFI Firmware con pflash - CORREGIDO
+        if (fs::exists(firmwarePath)) {
+            cmd.push_back("-drive");
+            cmd.push_back("if=pflash,format=raw,readonly=on,file=" + firmwarePath);
+            
+            // Los lanzamientos del pool corren en paralelo: uno podría copiar
+            // la NVRAM a medio crear
+            std::lock_guard<std::mutex> lock(firmwareMutex);
+            // Crear VARS file si no existe
+            if (!fs::exists(varsPath)) {
+                printLog("INFO", "Creating OVMF VARS file...");
+                std::ofstream varsFile(varsPath, std::ios::binary);
+                std::vector<char> emptyVars(64 * 1024, 0);
+                varsFile.write(emptyVars.data(), emptyVars.size());
+                varsFile.close();
+            }
+            // Cada instancia del pool arranca con su propia copia de la NVRAM
+            if (instance.varsPath != varsPath) {
+                std::error_code ec;
+                fs::copy_file(varsPath, instance.varsPath, fs::copy_options::overwrite_existing, ec);
+            }
+            cmd.push_back("-drive");
+            cmd.push_back("if=pflash,format=raw,file=" + instance.varsPath);
+        }
+        
+        // E/S de disco fuera del bucle principal de QEMU
+        for (int i = 0; i < ioThreadCount(); i++) {
+            cmd.push_back("-object");
+            cmd.push_back("iothread,id=io" + std::to_string(i));
+        }
+        
+        if (instance.paused) {
+            // CPUs paradas; disco e ISO se conectan por QMP al entregarla
+            cmd.push_back("-S");
+            cmd.push_back("-device");
+            cmd.push_back("ide-cd,id=cd0");
+        } else {
+            // Disco principal, o su overlay en modo efímero
+            if (fs::exists(diskPath)) {
+                for (const auto& node : instanceBlockdevs(diskPath, instance.overlayPath)) {
+                    cmd.push_back("-blockdev");
+                    cmd.push_back(node);
+                }
+                cmd.push_back("-device");
+                cmd.push_back(diskDevice());
+            }
+            // Al apagarse el invitado QEMU sigue vivo para consolidar el overlay
+            if (commitsOverlay(instance)) {
+                cmd.push_back("-no-shutdown");
+            }
+            
+            // ISO si existe
+            if (!isoFile.empty()) {
+                cmd.push_back("-cdrom");
+                cmd.push_back(isoFile);
+                printLog("INFO", "ISO found: " + fs::path(isoFile).filename().string());
+            }
+        }
+        
+        // Audio ALSA
+        cmd.push_back("-audiodev");
+        cmd.push_back("alsa,id=audio0");
+        cmd.push_back("-device");
+        cmd.push_back("intel-hda");
+        cmd.push_back("-device");
+        cmd.push_back("hda-duplex,audiodev=audio0");
+        
+        // Red con VirtIO
+        cmd.push_back("-netdev");
+        cmd.push_back("user,id=net0");
+        cmd.push_back("-device");
+        cmd.push_back("virtio-net-pci,netdev=net0");
+        
+        // USB para mejor mouse/teclado
+        cmd.push_back("-device");
+        cmd.push_back("usb-ehci");
+        cmd.push_back("-device");
+        cmd.push_back("usb-tablet");
+        
+        // Sincronización de tiempo
+        cmd.push_back("-rtc");
+        cmd.push_back("base=localtime,clock=host");
+        
+        // Socket QMP para detectar cuándo la máquina está lista
+        cmd.push_back("-qmp");
+        cmd.push_back("unix:" + instance.qmpSocketPath + ",server=on,wait=off");
+        
+        // Reanudar desde un estado guardado en vez de arrancar firmware y SO
+        if (!resumeFrom.empty() && &instance == &machine) {
+            cmd.push_back("-incoming");
+            cmd.push_back("file:" + resumeFrom);
+        }
+        
+        return cmd;
+    }
+
+    bool startProxy() {
+        if (!useVNC) return true;
+        
+        printLog("INFO", "Starting noVNC proxy...");
+        
+        // Verificar que noVNC existe
+        if (!fs::exists(noVNCPath)) {
+            printLog("ERROR", "noVNC directory not found!");
+            return false;
+        }
+        
+        auto start = Clock::now();
+        std::string error;
+        std::string vncSocket = vncTransport == "unix" ? machine.vncSocketPath : "";
+        WebSocketProxy::Options options = {proxyPort, noVNCPath, vncSocket, "127.0.0.1", 5900 + machine.vncDisplay};
+        options.splice = proxySplice;
+        options.adaptive = proxyAdaptive;
+        options.broadcast = proxyBroadcast;
+        if (!proxy.start(options, error)) {
+            printLog("ERROR", "Failed to listen on port " + std::to_string(proxyPort) + ": " + error);
+            return false;
+        }
+        timeline.record("proxy-ready", "step", start);
+        printDebug("Proxy listening on port " + std::to_string(proxyPort));
+        return true;
+    }
+
+    bool startQEMU(QEMUInstance& instance) {
+        printLog("INFO", "Starting QEMU virtual machine...");
+        
+        auto cmd = buildQEMUCommand(instance);
+        
+        // DEBUG: Imprimir comando completo
+        printDebug("QEMU command:");
+        std::string fullCmd = "";
+        for (const auto& arg : cmd) {
+            fullCmd += arg + " ";
+        }
+        printDebug(fullCmd);
+        
+        // stderr de QEMU va a un log para poder mostrarlo si muere al arrancar
+        unlink(instance.qmpSocketPath.c_str());
+        unlink(instance.vncSocketPath.c_str());
+        std::string error;
+        auto spawnStart = Clock::now();
+        if (!spawnProcess(cmd, instance.logPath, instance.process, error)) {
+            printLog("ERROR", "Failed to start QEMU process: " + error);
+            return false;
+        }
+        if (&instance == &machine) timeline.record("spawn", "step", spawnStart);
+        if (!waitForQEMU(instance)) {
+            // El kernel puede tener io_uring y QEMU estar compilado sin él. El
+            // pool lo decide antes de lanzar (settleDiskAIO): sus hilos leen diskAIO
+            if (&instance != &machine || instance.process.running() || !ioUringUnsupported(instance.logPath)) {
+                return false;
+            }
+            fallBackFromIoUring();
+            return startQEMU(instance);
+        }
+        if (pinPlan.enabled() && &instance == &machine) applyPinning(instance);
+        if (&instance == &machine) verifyNUMA(instance);
+        if (!resumeFrom.empty() && &instance == &machine) return waitForResume();
+        return true;
+    }
+
+    // Fija cada hilo de vCPU (según query-cpus-fast) a su CPU del host y el
+    // resto de hilos de QEMU al conjunto del emulador. Es una optimización:
+    // si falla se avisa y la máquina sigue sin fijar
+    void applyPinning(QEMUInstance& instance) {
+        auto start = Clock::now();
+        std::string reply;
+        if (!instance.qmp.execute("query-cpus-fast", reply, Clock::now() + std::chrono::milliseconds(qemuTimeoutMs))) {
+            printLog("ERROR", "Cannot pin vCPUs, query-cpus-fast failed: " + reply);
+            return;
+        }
+        
+        std::set<pid_t> vcpuThreads;
+        std::string pinned;
+        for (const auto& item : jsonArrayItems(reply)) {
+            int index = std::atoi(jsonField(item, "cpu-index").c_str());
+            pid_t tid = std::atoi(jsonField(item, "thread-id").c_str());
+            if (tid <= 0) continue;
+            vcpuThreads.insert(tid);
+            if (index < 0 || index >= static_cast<int>(pinPlan.vcpuHost.size()) || pinPlan.vcpuHost[index] < 0) continue;
+            int cpu = pinPlan.vcpuHost[index];
+            if (!setThreadAffinity(tid, {cpu})) {
+                printLog("ERROR", "Failed to pin vCPU " + std::to_string(index) + " to CPU " +
+                         std::to_string(cpu) + ": " + std::strerror(errno));
+                continue;
+            }
+            pinned += " " + std::to_string(index) + "->" + std::to_string(cpu);
+        }
+        printLog("INFO", "vCPU pinning:" + (pinned.empty() ? std::string(" none") : pinned));
+        
+        // Los hilos que cree QEMU después heredan la afinidad de quien los crea,
+        // que siempre es un hilo del emulador
+        if (pinPlan.emulatorCPUs.empty()) {
+            printLog("INFO", "No spare host cores, emulator threads share the vCPU cores");
+        } else {
+            int threads = 0;
+            std::error_code ec;
+            for (const auto& entry : fs::directory_iterator("/proc/" + std::to_string(instance.process.pid) + "/task", ec)) {
+                pid_t tid = std::atoi(entry.path().filename().c_str());
+                if (tid <= 0 || vcpuThreads.count(tid)) continue;
+                if (setThreadAffinity(tid, pinPlan.emulatorCPUs)) threads++;
+            }
+            printDebug("Emulator threads (" + std::to_string(threads) + ") on CPUs " +
+                       formatCPUList(pinPlan.emulatorCPUs));
+        }
+        timeline.record("pinning", "step", start);
+    }
+
+    // Comprueba en numa_maps que QEMU tiene una zona ligada por nodo del invitado
+    bool verifyNUMA(QEMUInstance& instance) {
+        size_t bound = std::count_if(numa.nodes.begin(), numa.nodes.end(),
+                                     [](const NUMALayout::Node& node) { return node.hostNode >= 0; });
+        if (bound == 0) return true;
+        
+        NUMAPlacement placement;
+        if (!NUMAPlacement::read(instance.process.pid, placement)) {
+            printLog("ERROR", "Cannot read numa_maps of QEMU");
+            return false;
+        }
+        if (placement.boundMappings < static_cast<int>(bound)) {
+            printLog("ERROR", "Expected " + std::to_string(bound) + " NUMA-bound memory backends, found " +
+                     std::to_string(placement.boundMappings));
+            return false;
+        }
+        if (placement.remoteBytes) {
+            printLog("INFO", "Guest memory partly on remote nodes: " + placement.summary());
+        } else {
+            printDebug("NUMA placement: " + placement.summary());
+        }
+        return true;
+    }
+
+    // Huella de la configuración de la máquina: -incoming exige el mismo
+    // tamaño, memoria y dispositivos. Sale de lo planificado, sin efectos
+    // secundarios y sin el modo de AIO, que cambia al arrancar QEMU si no
+    // tiene io_uring (fallBackFromIoUring)
+    std::string machineFingerprint() const {
+        std::ostringstream parts;
+        parts << "accel=" << accelerator << " smp=" << size.cpus << "," << size.sockets << "," << size.cores << ","
+              << size.threads << " memory=" << size.memory;
+        for (const auto& node : numa.nodes) {
+            parts << " node=" << formatCPUList(node.vcpus) << ":" << node.memory;
+        }
+        bool backend = !numa.nodes.empty() || !hugePagePath.empty() || memoryPrealloc;
+        parts << " backend=" << backend << " hugepages=" << hugePageSize << " firmware=" << fs::exists(firmwarePath)
+              << " disk=" << (fs::exists(diskPath) ? diskDevice() : "none") << " cdrom=" << !isoFile.empty();
+        std::ostringstream out;
+        out << std::hex << fnv1a64(parts.str());
+        return out.str();
+    }
+
+    std::map<std::string, std::string> diskIdentity() {
+        struct stat st = {};
+        stat(diskPath.c_str(), &st);
+        return {
+            {"disk", diskPath},
+            {"disk_size", std::to_string(st.st_size)},
+            {"disk_mtime_ns", std::to_string(st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec)},
+        };
+    }
+
+    // Comprueba que el estado guardado corresponde a este disco y esta configuración
+    bool checkResumeState(std::string& reason) {
+        if (!ephemeralMode.empty()) {
+            reason = "ephemeral machines start from a fresh overlay";
+            return false;
+        }
+        if (!fs::exists(statePath)) {
+            reason = "no saved state";
+            return false;
+        }
+        auto meta = readKeyValueFile(statePath + ".meta");
+        if (meta["version"] != "1") {
+            reason = "unsupported state format version '" + meta["version"] + "'";
+            return false;
+        }
+        for (const auto& entry : diskIdentity()) {
+            if (meta[entry.first] != entry.second) {
+                reason = "disk changed since suspend (" + entry.first + ")";
+                return false;
+            }
+        }
+        if (meta["machine"] != machineFingerprint()) {
+            reason = "machine configuration changed since suspend";
+            return false;
+        }
+        return true;
+    }
+
+    // Cliente RFB mínimo: pide el framebuffer completo y espera el primer FramebufferUpdate
+    bool probeFirstFrame(std::string& error) {
+        auto deadline = Clock::now() + std::chrono::milliseconds(proxyTimeoutMs);
+        bool local = vncTransport == "unix";
+        int fd = socket(local ? AF_UNIX : AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int result = -1;
+        if (local) {
+            sockaddr_un addr = {};
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, machine.vncSocketPath.c_str(), sizeof(addr.sun_path) - 1);
+            if (fd >= 0) result = connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        } else {
+            sockaddr_in addr = {};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(5900 + machine.vncDisplay);
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            if (fd >= 0) result = connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        }
+        if (result != 0) {
+            error = std::strerror(errno);
+            if (fd >= 0) close(fd);
+            return false;
+        }
+        
+        unsigned char buf[64];
+        bool ok = false;
+        do {
+            // Versión y seguridad "None"
+            if (!readExact(fd, buf, 12, deadline)) break;
+            if (send(fd, "RFB 003.008\n", 12, MSG_NOSIGNAL) != 12) break;
+            if (!readExact(fd, buf, 1, deadline) || buf[0] == 0) break;
+            std::vector<unsigned char> types(buf[0]);
+            if (!readExact(fd, types.data(), types.size(), deadline)) break;
+            if (std::find(types.begin(), types.end(), 1) == types.end()) {
+                error = "VNC server requires authentication";
+                break;
+            }
+            buf[0] = 1;
+            if (send(fd, buf, 1, MSG_NOSIGNAL) != 1 || !readExact(fd, buf, 4, deadline)) break;
+            uint32_t securityResult = (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+            if (securityResult != 0) break;
+            
+            // ClientInit compartido y ServerInit
+            buf[0] = 1;
+            if (send(fd, buf, 1, MSG_NOSIGNAL) != 1 || !readExact(fd, buf, 24, deadline)) break;
+            uint16_t width = (buf[0] << 8) | buf[1];
+            uint16_t height = (buf[2] << 8) | buf[3];
+            uint32_t nameLength = (buf[20] << 24) | (buf[21] << 16) | (buf[22] << 8) | buf[23];
+            std::vector<unsigned char> name(nameLength);
+            if (nameLength && !readExact(fd, name.data(), nameLength, deadline)) break;
+            
+            // FramebufferUpdateRequest no incremental de toda la pantalla
+            unsigned char request[10] = {3, 0, 0, 0, 0, 0, static_cast<unsigned char>(width >> 8),
+                                         static_cast<unsigned char>(width), static_cast<unsigned char>(height >> 8),
+                                         static_cast<unsigned char>(height)};
+            if (send(fd, request, sizeof(request), MSG_NOSIGNAL) != sizeof(request)) break;
+            ok = readExact(fd, buf, 1, deadline) && buf[0] == 0;
+        } while (false);
+        
+        if (!ok && error.empty()) error = "RFB handshake failed";
+        close(fd);
+        return ok;
+    }
+
+    // Tras cargar el estado QEMU pasa de "inmigrate" a "running"
+    bool waitForResume() {
+        auto start = Clock::now();
+        auto deadline = start + std::chrono::milliseconds(suspendTimeoutMs);
+        std::string status;
+        while (machine.qmp.execute("query-status", status, deadline)) {
+            std::string state = jsonField(status, "status");
+            if (state == "running") {
+                timeline.record("state-loaded", "step", start);
+                auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start);
+                printLog("INFO", "Machine resumed from " + resumeFrom + " (state loaded in " +
+                         std::to_string(elapsed.count()) + " ms)");
+                // El disco avanza desde aquí: el estado ya no es válido
+                std::error_code ec;
+                fs::remove(resumeFrom, ec);
+                fs::remove(resumeFrom + ".meta", ec);
+                return true;
+            }
+            if (state != "inmigrate" && state != "prelaunch" && state != "paused") {
+                printLog("ERROR", "Resume failed, QEMU status: " + state);
+                return false;
+            }
+            if (remainingMs(deadline) == 0) break;
+            usleep(10000);
+        }
+        printLog("ERROR", "Resume did not complete: " + status);
+        return false;
+    }
+
+    // Migra el estado de la máquina a statePath y termina QEMU
+    bool suspendToFile(std::string& error) {
+        // El estado apuntaría a un overlay que se borra al salir
+        if (!ephemeralMode.empty()) {
+            error = "cannot suspend an ephemeral machine";
+            return false;
+        }
+        QMPClient& qmp = machine.qmp;
+        auto start = Clock::now();
+        auto deadline = start + std::chrono::milliseconds(suspendTimeoutMs);
+        std::string reply;
+        
+        std::string tmpPath = statePath + ".tmp";
+        std::error_code ec;
+        fs::remove(tmpPath, ec);
+        
+        // Si algo falla se cancela la migración, se espera a que suelte el
+        // fichero y se reanuda la máquina. Va con plazo propio: el de la
+        // suspensión puede haber vencido y una respuesta sin leer se tomaría
+        // por la de la siguiente orden
+        auto abandon = [&]() {
+            auto cleanup = Clock::now() + std::chrono::milliseconds(qemuTimeoutMs);
+            std::string ignored;
+            qmp.execute("migrate_cancel", ignored, cleanup);
+            while (qmp.execute("query-migrate", ignored, cleanup)) {
+                std::string status = jsonField(ignored, "status");
+                if (status != "active" && status != "setup" && status != "cancelling" && status != "device") break;
+                if (remainingMs(cleanup) == 0) break;
+                usleep(10000);
+            }
+            qmp.execute("cont", ignored, cleanup);
+            fs::remove(tmpPath, ec);
+        };
+        
+        if (!qmp.execute("stop", reply, deadline) ||
+            !qmp.execute("migrate", reply, deadline, "{\"uri\": \"file:" + jsonEscape(tmpPath) + "\"}")) {
+            error = "cannot start migration: " + reply;
+            abandon();
+            return false;
+        }
+        
+        while (true) {
+            if (!qmp.execute("query-migrate", reply, deadline)) {
+                error = "query-migrate failed: " + reply;
+                abandon();
+                return false;
+            }
+            std::string status = jsonField(reply, "status");
+            if (status == "completed") break;
+            if (status == "failed" || status == "cancelled" || remainingMs(deadline) == 0) {
+                error = "migration " + (status.empty() ? std::string("timed out") : status) + " " +
+                        jsonField(reply, "error-desc");
+                abandon();
+                return false;
+            }
+            usleep(10000);
+        }
+        auto saved = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start);
+        
+        // QEMU debe haber cerrado el disco antes de registrar su identidad
+        qmp.execute("quit", reply, deadline);
+        qmp.disconnect();
+        stopChild(machine.process, "QEMU");
+        
+        auto meta = diskIdentity();
+        meta["version"] = "1";
+        meta["machine"] = machineFingerprint();
+        if (!writeKeyValueFile(statePath + ".meta", meta)) {
+            error = "cannot write " + statePath + ".meta";
+            return false;
+        }
+        fs::rename(tmpPath, statePath, ec);
+        if (ec) {
+            error = "cannot rename state file: " + ec.message();
+            return false;
+        }
+        printLog("INFO", "Machine suspended to " + statePath + " in " + std::to_string(saved.count()) + " ms (" +
+                 std::to_string(fs::file_size(statePath, ec) >> 20) + " MB)");
+        return true;
+    }
+
+    // QMP no responde hasta terminar de preasignar la memoria: 1 s más por GiB
+    int startupTimeoutMs() const {
+        return qemuTimeoutMs + (memoryPrealloc ? static_cast<int>(size.memory >> 30) * 1000 : 0);
+    }
+
+    // Espera a que QMP responda en vez de dormir un tiempo fijo
+    bool waitForQEMU(QEMUInstance& instance) {
+        ChildProcess& qemu = instance.process;
+        QMPClient& qmp = instance.qmp;
+        auto start = Clock::now();
+        int timeoutMs = startupTimeoutMs();
+        auto deadline = start + std::chrono::milliseconds(timeoutMs);
+        int retryMs = 5;
+        
+        while (Clock::now() < deadline && !bootInterrupted()) {
+            if (qmp.connectTo(instance.qmpSocketPath)) {
+                if (!qmp.handshake(deadline)) {
+                    qmp.disconnect();
+                    if (!qemu.alive()) break;
+                    continue;
+                }
+                bool traced = (&instance == &machine);
+                if (traced) timeline.record("qmp-ready", "step", start);
+                
+                std::string status;
+                if (!qmp.execute("query-status", status, deadline) ||
+                    jsonField(status, "status").empty()) {
+                    printLog("ERROR", "QMP query-status failed: " + status);
+                    return false;
+                }
+                
+                if (useVNC) {
+                    std::string vnc;
+                    if (!qmp.execute("query-vnc", vnc, deadline) || jsonField(vnc, "enabled") != "true") {
+                        printLog("ERROR", "QEMU VNC server is not enabled: " + vnc);
+                        return false;
+                    }
+                    if (jsonField(vnc, "family") == "unix") {
+                        printDebug("VNC listening on unix:" + jsonField(vnc, "host"));
+                    } else {
+                        printDebug("VNC listening on " + jsonField(vnc, "host") + ":" + jsonField(vnc, "service"));
+                    }
+                    if (traced) timeline.record("vnc-ready", "step", start);
+                }
+                
+                auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start);
+                printDebug("QEMU ready (" + jsonField(status, "status") + ") after " +
+                           std::to_string(elapsed.count()) + " ms");
+                return true;
+            }
+            
+            if (!qemu.alive()) break;
+            
+            // Despertar antes si QEMU muere mientras esperamos
+            if (qemu.pidfd >= 0) {
+                pollInterruptible(qemu.pidfd, POLLIN, std::min(retryMs, remainingMs(deadline)));
+            } else {
+                usleep(std::min(retryMs, remainingMs(deadline)) * 1000);
+            }
+            retryMs = std::min(retryMs * 2, 50);
+        }
+        
+        if (bootInterrupted()) return false;
+        if (qemu.alive()) {
+            printLog("ERROR", "QEMU did not become ready within " + std::to_string(timeoutMs) + " ms!");
+        } else {
+            printLog("ERROR", "QEMU exited during startup!");
+        }
+        printQEMULog(instance);
+        return false;
+    }
+
+    // QEMU sin CONFIG_LINUX_IO_URING rechaza aio=io_uring al abrir el disco
+    bool ioUringUnsupported(const std::string& logPath) const {
+        if (diskAIO != "io_uring") return false;
+        std::ifstream log(logPath);
+        std::string line;
+        while (std::getline(log, line)) {
+            if (line.find("io_uring") != std::string::npos) return true;
+        }
+        return false;
+    }
+
+    void fallBackFromIoUring() {
+        diskAIO = diskDirect ? "native" : "threads";
+        printLog("INFO", "QEMU cannot use io_uring, using aio=" + diskAIO);
+    }
+
+    // El pool fija el modo de AIO antes del primer lanzamiento: después lo
+    // leen a la vez los hilos de lanzamiento y el bucle. QEMU abre los
+    // -blockdev antes de crear dispositivos, así que con uno inexistente
+    // sale justo después de probar aio=io_uring sobre un fichero vacío
+    void settleDiskAIO() {
+        if (diskAIO != "io_uring") return;
+        std::string probe = runPath + "/aio-probe.img";
+        std::ofstream(probe).close();
+        std::string node = "{\"driver\": \"file\", \"node-name\": \"probe\", \"filename\": \"" + jsonEscape(probe) +
+                           "\", \"aio\": \"io_uring\"}";
+        std::string output;
+        captureOutput({"qemu-system-x86_64", "-machine", "none", "-nodefaults", "-display", "none", "-blockdev", node,
+                       "-device", "computer-aio-probe"}, output, qemuTimeoutMs);
+        unlink(probe.c_str());
+        if (output.find("io_uring") != std::string::npos) fallBackFromIoUring();
+    }
+
+    void printQEMULog(const QEMUInstance& instance) {
+        std::ifstream log(instance.logPath);
+        std::string line;
+        while (std::getline(log, line)) {
+            printLog("ERROR", "QEMU: " + line);
+        }
+    }
+
+    // Supervisa QEMU hasta que termine o llegue SIGINT/SIGTERM/SIGHUP.
+    // Las señales deben estar bloqueadas (ver main) para que las reciba el signalfd
+    int run() {
+        int sigfd = openSignalfd();
+        if (sigfd < 0) {
+            printLog("ERROR", "Failed to create signalfd: " + std::string(std::strerror(errno)));
+            cleanup();
+            return 1;
+        }
+        
+        EventLoop loop;
+        int exitCode = 0;
+        
+        ChildProcess& qemu = machine.process;
+        auto checkChildren = [&]() {
+            if (qemu.running() && !qemu.alive()) {
+                int status = qemu.status;
+                if (WIFEXITED(status)) {
+                    printLog("INFO", "QEMU exited with status " + std::to_string(WEXITSTATUS(status)));
+                    exitCode = WEXITSTATUS(status);
+                } else {
+                    printLog("ERROR", "QEMU killed by signal " + std::to_string(WTERMSIG(status)));
+                    exitCode = 1;
+                }
+                loop.stop();
+            }
+        };
+        
+        loop.add(sigfd, EPOLLIN, [&](uint32_t) {
+            signalfd_siginfo info;
+            while (read(sigfd, &info, sizeof(info)) == sizeof(info)) {
+                if (info.ssi_signo == SIGCHLD) {
+                    checkChildren();
+                } else {
+                    std::cout << std::endl;
+                    printLog("INFO", "Shutting down gracefully...");
+                    loop.stop();
+                }
+            }
+        });
+        if (qemu.running() && qemu.pidfd >= 0) {
+            loop.add(qemu.pidfd, EPOLLIN, [&](uint32_t) { checkChildren(); });
+        }
+        // Con -no-shutdown el apagado del invitado sólo se ve como evento QMP
+        int qmpFd = machine.qmp.descriptor();
+        if (commitsOverlay(machine) && qmpFd >= 0) {
+            loop.add(qmpFd, EPOLLIN, [&, qmpFd](uint32_t) {
+                if (machine.qmp.waitEvent("SHUTDOWN", Clock::now())) {
+                    printLog("INFO", "Guest powered off");
+                    machine.poweredOff = true;
+                    loop.remove(qmpFd);
+                    loop.stop();
+                } else if (!machine.qmp.isConnected()) {
+                    loop.remove(qmpFd);
+                }
+            });
+        }
+        
+        ControlServer control(loop);
+        control.listen(getControlSocketPath(), [&](const std::string& line) -> std::string {
+            if (line == "suspend") {
+                if (qemu.pidfd >= 0) loop.remove(qemu.pidfd);
+                std::string error;
+                if (!suspendToFile(error)) {
+                    printLog("ERROR", "Suspend failed: " + error);
+                    if (qemu.running() && qemu.pidfd >= 0) {
+                        loop.add(qemu.pidfd, EPOLLIN, [&](uint32_t) { checkChildren(); });
+                    }
+                    checkChildren();
+                    return "error " + error;
+                }
+                loop.stop();
+                return "ok state=" + statePath;
+            } else if (line == "status") {
+                std::string reply;
+                machine.qmp.execute("query-status", reply, Clock::now() + std::chrono::seconds(5));
+                return "ok status=" + jsonField(reply, "status");
+            } else if (line == "disk") {
+                return "ok " + diskProfileSummary(diskPath);
+            } else if (line == "proxy") {
+                if (!proxy.running()) return "error proxy not running";
+                return "ok " + proxy.summary();
+            } else if (line == "numa") {
+                NUMAPlacement placement;
+                if (!NUMAPlacement::read(machine.process.pid, placement)) return "error cannot read numa_maps";
+                return "ok " + placement.summary();
+            }
+            return "error unknown command: " + line;
+        });
+        
+        // Un hijo pudo haber terminado antes de registrar su pidfd
+        checkChildren();
+        loop.run();
+        
+        cleanup();
+        close(sigfd);
+        return exitCode;
+    }
+
+    void cleanup() {
+        shutdownQEMU(machine);
+        proxy.stop();
+    }
+
+    // Apagado ordenado: botón ACPI, luego quit por QMP, luego SIGTERM y por último SIGKILL
+    void shutdownQEMU(QEMUInstance& instance) {
+        const int stepTimeoutMs = 3000;
+        ChildProcess& qemu = instance.process;
+        QMPClient& qmp = instance.qmp;
+        if (!qemu.running()) {
+            qmp.disconnect();
+            return;
+        }
+        
+        auto start = Clock::now();
+        bool committed = false;
+        auto step = start;
+        auto stepMs = [&step]() {
+            auto now = Clock::now();
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - step).count();
+            step = now;
+            return std::to_string(ms) + " ms";
+        };
+        
+        // Una instancia del pool que nunca arrancó no puede atender el botón ACPI
+        if (qmp.isConnected() && instance.paused) {
+            std::string reply;
+            printLog("INFO", "Sending quit to paused QEMU...");
+            qmp.execute("quit", reply, Clock::now() + std::chrono::milliseconds(stepTimeoutMs));
+            qemu.waitExit(stepTimeoutMs);
+        } else if (qmp.isConnected()) {
+            std::string reply;
+            auto deadline = Clock::now() + std::chrono::milliseconds(shutdownTimeoutMs);
+            bool guestDown = instance.poweredOff;
+            if (!guestDown) {
+                printLog("INFO", "Sending ACPI power button to guest...");
+                guestDown = qmp.execute("system_powerdown", reply, deadline) && qmp.waitEvent("SHUTDOWN", deadline);
+                if (guestDown) {
+                    printLog("INFO", "Guest shut down after " + stepMs());
+                } else {
+                    printLog("INFO", "Guest did not shut down (" + stepMs() + ")");
+                }
+            }
+            
+            // Con -no-shutdown QEMU no sale solo: se consolida el overlay y luego quit
+            bool noShutdown = commitsOverlay(instance);
+            if (noShutdown) {
+                if (!guestDown) {
+                    printLog("ERROR", "Guest did not shut down cleanly, overlay not committed");
+                } else if (commitOverlay(instance)) {
+                    committed = true;
+                }
+            }
+            
+            if (guestDown && !noShutdown && qemu.waitExit(stepTimeoutMs)) {
+                printLog("INFO", "QEMU exited after " + stepMs());
+            } else if (qmp.isConnected()) {
+                printLog("INFO", "Sending quit to QEMU...");
+                qmp.execute("quit", reply, Clock::now() + std::chrono::milliseconds(stepTimeoutMs));
+                if (qemu.waitExit(stepTimeoutMs)) {
+                    printLog("INFO", "QEMU quit after " + stepMs());
+                }
+            }
+        }
+        qmp.disconnect();
+        
+        stopChild(qemu, "QEMU");
+        auto total = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count();
+        printLog("INFO", "QEMU stopped, shutdown took " + std::to_string(total) + " ms");
+        discardOverlay(instance, committed);
+    }
 
-public:
-    ComputerVM() {
-        diskPath = "./devices/disk/disk.qcow2";
-        romPath = "./devices/rom";
-        firmwarePath = "./boot/firmware/OVMF_CODE.fd";
-        noVNCPath = "./libraries/noVNC";
-        useVNC = true;
-        qemuPid = -1;
-        websockifyPid = -1;
+    // Un overlay sin consolidar en modo commit se conserva junto al disco
+    void discardOverlay(QEMUInstance& instance, bool committed) {
+        if (instance.overlayPath.empty()) return;
+        std::error_code ec;
+        if (commitsOverlay(instance) && !committed) {
+            std::string kept = diskPath + ".uncommitted.qcow2";
+            fs::rename(instance.overlayPath, kept, ec);
+            printLog("ERROR", "Overlay kept as " + kept + (ec ? " (" + ec.message() + ")" : ""));
+        } else {
+            fs::remove(instance.overlayPath, ec);
+            printDebug("Overlay " + instance.overlayPath + " removed");
+        }
+        instance.overlayPath.clear();
     }
 
-    void printLog(const std::string& level, const std::string& message) {
-        std::cout << "[" << level << "] " << message << std::endl;
+    // SIGTERM con plazo y SIGKILL si no basta
+    void stopChild(ChildProcess& child, const std::string& name) {
+        const int stepTimeoutMs = 3000;
+        if (!child.alive()) return;
+        
+        auto start = Clock::now();
+        printLog("INFO", "Sending SIGTERM to " + name + "...");
+        child.sendSignal(SIGTERM);
+        if (!child.waitExit(stepTimeoutMs)) {
+            printLog("INFO", name + " ignored SIGTERM, sending SIGKILL...");
+            child.sendSignal(SIGKILL);
+            child.waitExit(-1);
+        }
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count();
+        printDebug(name + " stopped after " + std::to_string(ms) + " ms");
     }
 
-    void printDebug(const std::string& message) {
-        std::cout << "[DEBUG] " << message << std::endl;
+    bool boot() {
+        printLog("LOG", "Booting Computer..");
+        printDebug("Checking components..");
+        
+        // Ctrl-C durante el arranque: las esperas vigilan este signalfd y la
+        // señal queda pendiente, sin leer, hasta decidir qué hacer
+        sigset_t stopSignals = supervisedSignals();
+        sigdelset(&stopSignals, SIGCHLD);
+        int sigfd = signalfd(-1, &stopSignals, SFD_NONBLOCK | SFD_CLOEXEC);
+        bootInterruptFd = sigfd;
+        
+        // Las fases independientes corren en paralelo; el proxy arranca mientras QEMU inicia
+        timeline.reset();
+        BootGraph graph(&timeline);
+        graph.add("directories", {}, [this]() {
+            createDirectories();
+            return true;
+        });
+        graph.add("firmware", {"directories"}, [this]() {
+            checkFile(firmwarePath, "Firmware");
+            return true;
+        });
+        graph.add("disk", {"directories"}, [this]() {
+            diskOk = checkFile(diskPath, "Disk");
+            if (diskOk) {
+                printDebug("Disk profile: " + diskProfileSummary(diskPath));
+            } else {
+                diskOk = createDefaultDisk();
+            }
+            if (diskOk && !ephemeralMode.empty()) {
+                auto start = Clock::now();
+                std::string error;
+                machine.overlayPath = runPath + "/overlay.qcow2";
+                if (!createOverlay(diskPath, machine.overlayPath, error)) {
+                    printLog("ERROR", "Failed to create disk overlay: " + error);
+                    machine.overlayPath.clear();
+                    return false;
+                }
+                timeline.record("overlay-create", "step", start);
+                printLog("INFO", "Ephemeral machine: writes go to " + machine.overlayPath + " (" +
+                         (ephemeralMode == "commit" ? "committed" : "discarded") + " on exit)");
+            }
+            return true;
+        });
+        graph.add("diskio", {"directories", "sizing"}, [this]() {
+            return planDiskIO();
+        });
+        graph.add("iso", {"directories"}, [this]() {
+            isoFile = findISO();
+            printDebug(isoFile.empty() ? "ISO available.. No" : "ISO available.. Yes");
+            return true;
+        });
+        graph.add("media", {"disk", "iso"}, [this]() {
+            if (!diskOk && isoFile.empty()) {
+                printLog("ERROR", "No disk or ISO available!");
+                return false;
+            }
+            if (!isoFile.empty() && fs::exists(diskPath)) {
+                printLog("INFO", "Booting from ISO with disk available!");
+            } else if (!isoFile.empty()) {
+                printLog("INFO", "Booting from ISO only!");
+            } else {
+                printLog("INFO", "There's no ISO on rom/, Booting from disk!");
+            }
+            return true;
+        });
+        graph.add("libraries", {}, [this]() {
+            printDebug("Checking Libraries..");
+            bool noVNCOk = checkFile(noVNCPath, "noVNC");
+            
+            if (useVNC && !noVNCOk) {
+                printLog("ERROR", "Required libraries not found for VNC mode!");
+                return false;
+            }
+            return true;
+        });
+        graph.add("sizing", {}, [this]() {
+            return planMachine();
+        });
+        graph.add("state", {"firmware", "media", "sizing", "diskio"}, [this]() {
+            if (!resumeRequested) return true;
+            std::string reason;
+            if (checkResumeState(reason)) {
+                resumeFrom = statePath;
+                printLog("INFO", "Resuming from saved state " + statePath);
+            } else {
+                printLog("INFO", "Cannot resume (" + reason + "), booting normally");
+            }
+            return true;
+        });
+        graph.add("qemu", {"firmware", "media", "libraries", "sizing", "diskio", "state"}, [this]() {
+            printDebug("Starting Machine..");
+            return startQEMU(machine);
+        });
+        if (useVNC) {
+            graph.add("proxy", {"libraries"}, [this]() {
+                return startProxy();
+            });
+            graph.add("framebuffer", {"qemu"}, [this]() {
+                // Sólo mide; un fallo aquí no impide el arranque
+                auto start = Clock::now();
+                std::string error;
+                if (probeFirstFrame(error)) {
+                    timeline.record("first-framebuffer", "step", start);
+                } else {
+                    printDebug("First framebuffer update not seen: " + error);
+                }
+                return true;
+            });
+        }
+        
+        bool ok = graph.run();
+        interrupted = bootInterrupted();
+        bootInterruptFd = -1;
+        if (sigfd >= 0) close(sigfd);
+        
+        printDebug("Boot timing:");
+        for (const auto& line : graph.report()) {
+            printDebug("  " + line);
+        }
+        printLog("INFO", "Boot timeline: " + timeline.summary());
+        if (!tracePath.empty()) {
+            if (timeline.writeChromeTrace(tracePath)) {
+                printDebug("Boot trace written to " + tracePath);
+            } else {
+                printLog("ERROR", "Failed to write boot trace " + tracePath);
+            }
+        }
+        
+        if (interrupted) {
+            std::cout << std::endl;
+            printLog("INFO", "Boot interrupted, shutting down...");
+            cleanup();
+            return false;
+        }
+        if (!ok) {
+            cleanup();
+            return false;
+        }
+        
+        if (useVNC) {
+            std::string port = std::to_string(proxyPort);
+            printLog("INFO", "Port " + port + " For Machine Opened! Go to http://localhost:" + port +
+                     "/vnc.html?resize=remote&autoconnect=true");
+        } else {
+            printLog("INFO", "Machine started in full-screen mode!");
+        }
+        
+        return true;
     }
 
-    bool checkFile(const std::string& path, const std::string& name) {
-        if (fs::exists(path)) {
-            printDebug(name + " available.. Yes!");
+    // Política de E/S del disco. "none": O_DIRECT (sin doble caché en el host)
+    // con io_uring o, si el kernel no lo tiene, AIO nativo. "writeback" y
+    // "unsafe" (ignora los flush; para máquinas desechables) usan la caché
+    // de páginas del host, donde el AIO nativo no es asíncrono
+    bool planDiskIO() {
+        if (diskCache != "none" && diskCache != "writeback" && diskCache != "unsafe") {
+            printLog("ERROR", "Unknown disk cache mode: " + diskCache);
+            return false;
+        }
+        bool ioUring = probeIoUring();
+        std::string cache = diskCache;
+        std::string diskDir = fs::path(diskPath).parent_path().string();
+        if (cache == "none" && !supportsDirectIO(diskDir)) {
+            printLog("INFO", "Filesystem of " + diskDir + " does not support O_DIRECT, using writeback cache");
+            cache = "writeback";
+        }
+        
+        diskDirect = (cache == "none");
+        if (ioUring) {
+            diskAIO = "io_uring";
+        } else {
+            diskAIO = diskDirect ? "native" : "threads";
+            printDebug("io_uring not available in this kernel");
+        }
+        diskCache = cache;
+
+        // Varios IOThreads en un disco sólo con iothread-vq-mapping (QEMU 9.0)
+        if (ioThreadCount() > 1) {
+            std::string help;
+            captureOutput({"qemu-system-x86_64", "-device", "virtio-blk-pci,help"}, help, qemuTimeoutMs);
+            if (help.find("iothread-vq-mapping") == std::string::npos) {
+                printLog("INFO", "QEMU does not support iothread-vq-mapping (needs 9.0), using a single IOThread");
+                ioThreads = 1;
+            }
+        }
+        printLog("INFO", "Disk I/O: aio=" + diskAIO + ", cache=" + diskCache + ", iothreads=" +
+                 std::to_string(ioThreadCount()));
+        return true;
+    }
+
+    // Aplica la política de tamaño: "N"/"8G" fijo (4 y 4G por defecto), "50%"
+    // del host, o un perfil
+    bool planMachine() {
+        host = HostTopology::detect();
+        int hostCPUs = static_cast<int>(host.cpus.size());
+        
+        std::string cpuRule = cpuPolicy;
+        std::string memoryRule = memoryPolicy;
+        static const std::map<std::string, std::pair<std::string, std::string>> profiles = {
+            {"small", {"2", "2G"}},
+            {"medium", {"4", "4G"}},
+            {"large", {"75%", "75%"}},
+        };
+        if (!machineProfile.empty()) {
+            auto profile = profiles.find(machineProfile);
+            if (profile == profiles.end()) {
+                printLog("ERROR", "Unknown machine profile: " + machineProfile);
+                return false;
+            }
+            cpuRule = profile->second.first;
+            memoryRule = profile->second.second;
+        }
+        
+        int cpus;
+        if (!cpuRule.empty() && cpuRule.back() == '%') {
+            cpus = std::max(1, hostCPUs * std::atoi(cpuRule.c_str()) / 100);
+        } else {
+            cpus = std::atoi(cpuRule.c_str());
+        }
+        uint64_t memory;
+        if (!memoryRule.empty() && memoryRule.back() == '%') {
+            memory = host.memTotal / 100 * std::atoi(memoryRule.c_str());
+        } else {
+            memory = parseSize(memoryRule);
+        }
+        if (cpus <= 0 || memory == 0) {
+            printLog("ERROR", "Invalid machine size policy: cpus=" + cpuPolicy + " memory=" + memoryPolicy);
+            return false;
+        }
+        
+        // Nunca más vCPUs que CPUs del host ni más memoria que la del host
+        if (cpus > hostCPUs) {
+            printLog("INFO", "Limiting vCPUs from " + std::to_string(cpus) + " to host's " + std::to_string(hostCPUs));
+            cpus = hostCPUs;
+        }
+        if (host.memTotal && memory > host.memTotal * 9 / 10) {
+            memory = host.memTotal * 9 / 10;
+            printLog("INFO", "Limiting guest memory to 90% of host memory");
+        }
+        
+        size = MachineSize::plan(host, cpus, memory);
+        printLog("INFO", "Machine size: " + std::to_string(size.cpus) + " vCPUs (" + std::to_string(size.sockets) +
+                 " sockets x " + std::to_string(size.cores) + " cores x " + std::to_string(size.threads) +
+                 " threads), " + std::to_string(size.memory >> 20) + " MB");
+        printDebug("Host: " + std::to_string(hostCPUs) + " CPUs in " + std::to_string(host.packages) +
+                   " packages, " + std::to_string(host.threadsPerCore) + " threads/core, " +
+                   std::to_string(host.coresPerCache) + " cores/LLC, " + std::to_string(host.nodeCPUs.size()) +
+                   " NUMA nodes, " + std::to_string(host.memTotal >> 20) + " MB (" +
+                   std::to_string(host.memAvailable >> 20) + " MB available)");
+        if (host.memAvailable && size.memory > host.memAvailable) {
+            printLog("INFO", "Guest memory exceeds currently available host memory");
+        }
+        return planAccelerator() && planPinning() && planNUMA() && planHugePages();
+    }
+
+    // KVM si /dev/kvm responde; si no, TCG con un hilo por vCPU y una caché
+    // de código traducido de 1/8 de la RAM del invitado (entre 256M y 2G)
+    bool planAccelerator() {
+        std::string reason;
+        if (accelPolicy == "kvm" || (accelPolicy == "auto" && probeKVM(reason))) {
+            accelerator = "kvm";
+            printLog("INFO", "Accelerator: KVM");
+            return true;
+        }
+        if (accelPolicy != "auto" && accelPolicy != "tcg") {
+            printLog("ERROR", "Unknown accelerator: " + accelPolicy);
+            return false;
+        }
+        
+        accelerator = "tcg";
+        tcgCacheSize = std::min<uint64_t>(std::max<uint64_t>(size.memory / 8, 256ULL << 20), 2ULL << 30);
+        tcgCacheSize &= ~((1ULL << 20) - 1);
+        if (!reason.empty()) printLog("INFO", "KVM not available (" + reason + ")");
+        printLog("INFO", "Accelerator: TCG, " + std::to_string(size.cpus) + " translation threads, " +
+                 std::to_string(tcgCacheSize >> 20) + " MB code cache; expect the guest to run 5-20x slower than with KVM");
+        return true;
+    }
+
+    // THP por defecto. Con --hugepages auto/1G/2M, páginas de hugetlbfs si
+    // hay bastantes libres para todas las máquinas (por nodo cuando la
+    // memoria va ligada), si no THP. Reservar toda la memoria al
+    // arrancar con varios hilos es opcional (--prealloc on)
+    bool planHugePages() {
+        hugePagePath.clear();
+        hugePageSize = 0;
+        memoryPrealloc = false;
+        preallocThreads = std::max(1, static_cast<int>(host.cpus.size()) / host.threadsPerCore);
+        if (hugePagePolicy == "off") return true;
+        
+        std::vector<uint64_t> candidates;
+        if (hugePagePolicy == "auto") {
+            candidates = {1ULL << 30, 2ULL << 20};
+        } else if (hugePagePolicy == "1G" || hugePagePolicy == "2M") {
+            candidates = {parseSize(hugePagePolicy)};
+        } else if (hugePagePolicy != "thp") {
+            printLog("ERROR", "Unknown hugepage policy: " + hugePagePolicy);
+            return false;
+        }
+        
+        HugePageInfo info = HugePageInfo::detect();
+        for (uint64_t pageSize : candidates) {
+            std::string name = formatSize(pageSize);
+            auto mount = info.mounts.find(pageSize);
+            if (mount == info.mounts.end()) {
+                printLog("INFO", "Not using " + name + " hugepages: no hugetlbfs mount for them");
+                continue;
+            }
+            
+            // Páginas necesarias por nodo del host (-1: cualquiera)
+            std::map<int, uint64_t> needed;
+            if (numa.nodes.empty()) {
+                needed[-1] = (size.memory + pageSize - 1) / pageSize;
+            }
+            for (const auto& node : numa.nodes) {
+                needed[node.hostNode] += (node.memory + pageSize - 1) / pageSize;
+            }
+            std::string reason;
+            for (const auto& entry : needed) {
+                uint64_t available = HugePageInfo::freePages(pageSize, entry.first);
+                if (available < entry.second * hugePageGuests) {
+                    reason = std::to_string(available) + " free" +
+                             (entry.first >= 0 ? " on node " + std::to_string(entry.first) : "") + ", " +
+                             std::to_string(entry.second * hugePageGuests) + " needed" +
+                             (hugePageGuests > 1 ? " for " + std::to_string(hugePageGuests) + " machines" : "");
+                    break;
+                }
+            }
+            if (!reason.empty()) {
+                printLog("INFO", "Not using " + name + " hugepages: " + reason);
+                continue;
+            }
+            
+            // Cada backend debe ser múltiplo del tamaño de página
+            size.memory = 0;
+            for (auto& node : numa.nodes) {
+                node.memory = (node.memory + pageSize - 1) / pageSize * pageSize;
+                size.memory += node.memory;
+            }
+            if (numa.nodes.empty()) size.memory = needed[-1] * pageSize;
+            hugePagePath = mount->second;
+            hugePageSize = pageSize;
+            memoryPrealloc = preallocRequested;
+            printLog("INFO", "Guest RAM on " + name + " hugepages from " + hugePagePath + preallocNote());
+            return true;
+        }
+        
+        if (info.thpMode == "never") {
+            printLog("INFO", "Transparent hugepages are disabled, guest RAM uses normal pages");
             return true;
+        }
+        // Preasignar más de lo disponible acabaría con QEMU muerto por OOM
+        if (preallocRequested && host.memAvailable && size.memory > host.memAvailable) {
+            printLog("INFO", "Guest RAM on transparent hugepages (" + info.thpMode +
+                     "), not preallocated: larger than available host memory");
+            return true;
+        }
+        memoryPrealloc = preallocRequested;
+        printLog("INFO", "Guest RAM on transparent hugepages (" + info.thpMode + ")" + preallocNote());
+        return true;
+    }
+
+    std::string preallocNote() const {
+        return memoryPrealloc ? ", preallocated with " + std::to_string(preallocThreads) + " threads" : "";
+    }
+
+    // Nodos del invitado que reflejan la afinidad de las vCPUs; "off" deja -m a secas
+    bool planNUMA() {
+        numa = NUMALayout();
+        if (numaPolicy == "off") return true;
+        if (numaPolicy != "auto") {
+            printLog("ERROR", "Unknown NUMA policy: " + numaPolicy);
+            return false;
+        }
+        
+        numa = NUMALayout::plan(host, size, pinPlan);
+        for (size_t i = 0; i < numa.nodes.size(); i++) {
+            const auto& node = numa.nodes[i];
+            std::string target = node.hostNode >= 0 ? "host node " + std::to_string(node.hostNode) : "unbound";
+            printDebug("Guest NUMA node " + std::to_string(i) + ": vCPUs " + formatCPUList(node.vcpus) + ", " +
+                       std::to_string(node.memory >> 20) + " MB, " + target);
+            auto hostMemory = host.nodeMemory.find(node.hostNode);
+            if (hostMemory != host.nodeMemory.end() && node.memory > hostMemory->second) {
+                printLog("INFO", "Guest node " + std::to_string(i) + " is larger than host node " +
+                         std::to_string(node.hostNode) + ", binding may fail");
+            }
+        }
+        if (!pinPlan.enabled() && host.nodeCPUs.size() > 1) {
+            printLog("INFO", "Host has " + std::to_string(host.nodeCPUs.size()) +
+                     " NUMA nodes; use --pin to bind guest memory to the vCPUs' nodes");
+        }
+        return true;
+    }
+
+    // Plan de afinidad: "auto" a partir de la topología o un mapa "vcpu:cpu,..."
+    bool planPinning() {
+        pinPlan = PinPlan();
+        if (pinPolicy.empty()) return true;
+        
+        if (pinPolicy == "auto") {
+            pinPlan = PinPlan::automatic(host, size);
         } else {
-            printDebug(name + " available.. No");
+            std::string error;
+            if (!PinPlan::parse(pinPolicy, host, size.cpus, pinPlan, error)) {
+                printLog("ERROR", "Invalid pin map '" + pinPolicy + "': " + error);
+                return false;
+            }
+        }
+        if (!emulatorCPUList.empty()) {
+            pinPlan.emulatorCPUs = parseCPUList(emulatorCPUList);
+        }
+        
+        std::string map;
+        for (size_t i = 0; i < pinPlan.vcpuHost.size(); i++) {
+            if (pinPlan.vcpuHost[i] >= 0) map += " " + std::to_string(i) + "->" + std::to_string(pinPlan.vcpuHost[i]);
+        }
+        printDebug("Pin plan:" + map + ", emulator on " +
+                   (pinPlan.emulatorCPUs.empty() ? std::string("shared cores") : formatCPUList(pinPlan.emulatorCPUs)));
+        return true;
+    }
+
+    // Instancia pausada para el pool, con sus ficheros en runPath/pool-<id>
+    std::unique_ptr<QEMUInstance> makePoolInstance(int id) {
+        auto instance = std::make_unique<QEMUInstance>();
+        std::string dir = runPath + "/pool-" + std::to_string(id);
+        std::error_code ec;
+        fs::create_directories(dir, ec);
+        instance->id = id;
+        instance->qmpSocketPath = dir + "/qmp.sock";
+        instance->logPath = dir + "/qemu.log";
+        instance->varsPath = dir + "/OVMF_VARS.fd";
+        instance->vncSocketPath = dir + "/vnc.sock";
+        instance->vncDisplay = 1 + id;
+        instance->paused = true;
+        return instance;
+    }
+
+    void removeInstanceFiles(const QEMUInstance& instance) {
+        std::error_code ec;
+        fs::remove_all(fs::path(instance.qmpSocketPath).parent_path(), ec);
+    }
+
+    // Conecta disco e ISO a una instancia pausada y arranca sus CPUs
+    bool handOut(QEMUInstance& instance, const std::string& disk, const std::string& iso, std::string& error) {
+        QMPClient& qmp = instance.qmp;
+        auto deadline = Clock::now() + std::chrono::milliseconds(qemuTimeoutMs);
+        std::string reply;
+        
+        if (!disk.empty()) {
+            // En modo efímero cada instancia escribe en su propio overlay, que
+            // se borra con sus ficheros al liberarla; el base nunca se modifica
+            if (!ephemeralMode.empty()) {
+                instance.overlayPath = fs::path(instance.qmpSocketPath).parent_path().string() + "/overlay.qcow2";
+                if (!createOverlay(disk, instance.overlayPath, error)) {
+                    error = "cannot create overlay: " + error;
+                    instance.overlayPath.clear();
+                    return false;
+                }
+            }
+            bool added = true;
+            for (const auto& node : instanceBlockdevs(disk, instance.overlayPath)) {
+                added = qmp.execute("blockdev-add", reply, deadline, node);
+                if (!added) break;
+            }
+            if (!added) {
+                error = "cannot open disk: " + reply;
+                return false;
+            }
+            if (instance.overlayPath.empty()) instance.diskPath = disk;
+            if (!qmp.execute("device_add", reply, deadline, diskDevice())) {
+                error = "cannot attach disk: " + reply;
+                return false;
+            }
+        }
+        if (!iso.empty()) {
+            std::string medium = "{\"id\": \"cd0\", \"filename\": \"" + jsonEscape(iso) +
+                                 "\", \"format\": \"raw\", \"read-only-mode\": \"read-only\"}";
+            if (!qmp.execute("blockdev-change-medium", reply, deadline, medium)) {
+                error = "cannot insert ISO: " + reply;
+                return false;
+            }
+        }
+        
+        // El reset regenera el orden de arranque del firmware con los dispositivos nuevos
+        if (!qmp.execute("system_reset", reply, deadline) || !qmp.execute("cont", reply, deadline)) {
+            error = "cannot start CPUs: " + reply;
             return false;
         }
+        instance.paused = false;
+        return true;
+    }
+
+    const std::string& getDiskPath() const {
+        return diskPath;
+    }
+
+    bool isEphemeral() const {
+        return !ephemeralMode.empty();
+    }
+
+    bool wasInterrupted() const {
+        return interrupted;
+    }
+
+    std::string getControlSocketPath() const {
+        return runPath + "/control.sock";
+    }
+
+    void setVNCMode(bool enabled) {
+        useVNC = enabled;
+    }
+
+    void setVNCTransport(const std::string& transport) {
+        vncTransport = transport;
+    }
+
+    // Argumento de -vnc: socket UNIX (sin puerto fijo ni acceso de otros
+    // usuarios) o display TCP 5900+N
+    std::string vncAddress(const QEMUInstance& instance) const {
+        if (vncTransport == "unix") return "unix:" + instance.vncSocketPath;
+        return ":" + std::to_string(instance.vncDisplay);
+    }
+
+    void setQEMUTimeout(int timeoutMs) {
+        qemuTimeoutMs = timeoutMs;
+    }
+
+    void setProxyTimeout(int timeoutMs) {
+        proxyTimeoutMs = timeoutMs;
+    }
+
+    void setProxySplice(bool enabled) {
+        proxySplice = enabled;
+    }
+
+    void setProxyAdaptive(bool enabled) {
+        proxyAdaptive = enabled;
+    }
+
+    void setProxyBroadcast(bool enabled) {
+        proxyBroadcast = enabled;
+    }
+
+    void setShutdownTimeout(int timeoutMs) {
+        shutdownTimeoutMs = timeoutMs;
+    }
+
+    void setResume(bool enabled) {
+        resumeRequested = enabled;
+    }
+
+    void setTracePath(const std::string& path) {
+        tracePath = path;
+    }
+
+    void setCPUPolicy(const std::string& policy) {
+        cpuPolicy = policy;
+    }
+
+    void setMemoryPolicy(const std::string& policy) {
+        memoryPolicy = policy;
+    }
+
+    void setMachineProfile(const std::string& profile) {
+        machineProfile = profile;
+    }
+
+    void setPinPolicy(const std::string& policy) {
+        pinPolicy = policy;
+    }
+
+    void setEmulatorCPUs(const std::string& list) {
+        emulatorCPUList = list;
+    }
+
+    void setNUMAPolicy(const std::string& policy) {
+        numaPolicy = policy;
+    }
+
+    void setHugePagePolicy(const std::string& policy) {
+        hugePagePolicy = policy;
+    }
+
+    void setMemoryPrealloc(bool enabled) {
+        preallocRequested = enabled;
+    }
+
+    void setHugePageGuests(int count) {
+        hugePageGuests = count;
+    }
+
+    void setIOThreads(int count) {
+        ioThreads = count;
+    }
+
+    void setDiskCache(const std::string& mode) {
+        diskCache = mode;
+    }
+
+    void setEphemeralMode(const std::string& mode) {
+        ephemeralMode = mode;
+    }
+
+    void setAccelerator(const std::string& policy) {
+        accelPolicy = policy;
+    }
+
+    void setDiskSize(uint64_t bytes) {
+        diskOptions.virtualSize = bytes;
+        diskOverrides.insert("size");
+    }
+
+    // bytes ya validado: potencia de dos entre 512 y 2M
+    void setDiskClusterSize(uint64_t bytes) {
+        diskOptions.clusterBits = 0;
+        while ((1ULL << diskOptions.clusterBits) < bytes) diskOptions.clusterBits++;
+        diskOverrides.insert("cluster_size");
+    }
+
+    void setDiskProfile(const std::string& profile) {
+        diskProfile = profile;
+    }
+
+    void setDiskPreallocation(const std::string& mode) {
+        diskOptions.preallocation = mode;
+        diskOverrides.insert("preallocation");
+    }
+
+    void setDiskLazyRefcounts(bool enabled) {
+        diskOptions.lazyRefcounts = enabled;
+        diskOverrides.insert("lazy_refcounts");
+    }
+
+    void setDiskExtendedL2(bool enabled) {
+        diskOptions.extendedL2 = enabled;
+        diskOverrides.insert("extended_l2");
+    }
+};
+
+// Pool de máquinas QEMU prelanzadas y pausadas (-S). Una orden "acquire" por el
+// socket de control conecta disco e ISO a una de ellas y la arranca con "cont";
+// el pool se rellena en segundo plano cuando baja de poolMin instancias
+class MachinePool {
+private:
+    ComputerVM& vm;
+    int poolSize;
+    int poolMin;
+    EventLoop loop;
+    int wakeFd;
+    std::mutex mutex;
+    std::condition_variable launchesDone;
+    std::vector<std::unique_ptr<QEMUInstance>> launched; // listas, aún sin registrar en el loop
+    std::vector<std::unique_ptr<QEMUInstance>> ready;
+    std::vector<std::unique_ptr<QEMUInstance>> assigned;
+    int starting;
+    int launchFailures; // fallos aún no vistos por el loop
+    std::set<int> usedIds; // ids vivos; el display VNC es 1 + id
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t failures;
+    double totalLatencyMs;
+    double maxLatencyMs;
+
+    // Peticiones de acquire que esperan a un arranque en frío
+    struct PendingAcquire {
+        uint64_t ticket;
+        std::string disk;
+        std::string iso;
+        Clock::time_point start;
+    };
+    ControlServer* control;
+    std::deque<PendingAcquire> pending;
+
+    // El id libre más bajo, para que los displays VNC no crezcan sin límite
+    int allocateId() {
+        int id = 1;
+        while (usedIds.count(id)) id++;
+        usedIds.insert(id);
+        return id;
+    }
+
+    // Lanza una instancia en un hilo; al estar lista se avisa al loop por wakeFd
+    void launchAsync() {
+        int id;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            starting++;
+            id = allocateId();
+        }
+        std::thread([this, id]() {
+            auto instance = vm.makePoolInstance(id);
+            bool ok = vm.startQEMU(*instance);
+            if (!ok) {
+                vm.shutdownQEMU(*instance);
+                vm.removeInstanceFiles(*instance);
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (ok) {
+                launched.push_back(std::move(instance));
+            } else {
+                failures++;
+                launchFailures++;
+                usedIds.erase(id);
+            }
+            starting--;
+            uint64_t one = 1;
+            if (write(wakeFd, &one, sizeof(one)) < 0) {}
+            launchesDone.notify_all();
+        }).detach();
+    }
+
+    void refill() {
+        int missing;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            int available = static_cast<int>(ready.size() + launched.size()) + starting;
+            missing = available < poolMin ? poolSize - available : 0;
+        }
+        for (int i = 0; i < missing; i++) {
+            launchAsync();
+        }
     }
 
-    std::string findISO() {
-        printDebug("Checking for ISO files...");
-        try {
-            for (const auto& entry : fs::directory_iterator(romPath)) {
-                if (entry.path().extension() == ".iso") {
-                    return entry.path().string();
-                }
-            }
-        } catch (const fs::filesystem_error& e) {
-            printDebug("Error checking ROM directory: " + std::string(e.what()));
+    void watch(QEMUInstance& instance) {
+        int id = instance.id;
+        if (instance.process.pidfd >= 0) {
+            loop.add(instance.process.pidfd, EPOLLIN, [this, id](uint32_t) { onExit(id); });
         }
-        return "";
     }
 
-    void createDirectories() {
-        try {
-            fs::create_directories("./devices/disk");
-            fs::create_directories("./devices/rom");
-            fs::create_directories("./boot/firmware");
-            fs::create_directories("./libraries");
-        } catch (const fs::filesystem_error& e) {
-            printLog("ERROR", "Failed to create directories: " + std::string(e.what()));
+    void onLaunched() {
+        uint64_t count;
+        if (read(wakeFd, &count, sizeof(count)) < 0) {}
+        std::vector<std::unique_ptr<QEMUInstance>> fresh;
+        int failed;
+        int inFlight;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            fresh.swap(launched);
+            failed = launchFailures;
+            launchFailures = 0;
+            inFlight = starting;
+        }
+        for (auto& instance : fresh) {
+            watch(*instance);
+            vm.printLog("INFO", "Pool machine " + std::to_string(instance->id) + " ready");
+            ready.push_back(std::move(instance));
+        }
+        servePending();
+        // Cada petición en espera tiene su arranque; si falló se le contesta
+        while (failed > 0 && static_cast<int>(pending.size()) > inFlight) {
+            if (control) control->respond(pending.front().ticket, "error cannot launch QEMU");
+            pending.pop_front();
+            failed--;
         }
     }
 
-    bool createDefaultDisk() {
-        if (!fs::exists(diskPath)) {
-            printLog("INFO", "Creating default 20GB disk...");
-            std::string cmd = "qemu-img create -f qcow2 \"" + diskPath + "\" 20G";
-            int result = system(cmd.c_str());
-            if (result == 0) {
-                printLog("INFO", "Default disk created successfully!");
-                return true;
-            } else {
-                printLog("ERROR", "Failed to create default disk!");
-                return false;
-            }
+    void servePending() {
+        while (!pending.empty() && !ready.empty()) {
+            PendingAcquire request = pending.front();
+            pending.pop_front();
+            std::string reply = handOut(request.disk, request.iso, request.start, false);
+            if (control) control->respond(request.ticket, reply);
         }
-        return true;
     }
 
-    std::vector<std::string> buildQEMUCommand() {
-        std::vector<std::string> cmd;
-        
-        cmd.push_back("qemu-system-x86_64");
-        
-        // Básicos
-        cmd.push_back("-enable-kvm");
-        cmd.push_back("-cpu");
-        cmd.push_back("host");
-        cmd.push_back("-smp");
-        cmd.push_back("4");
-        cmd.push_back("-m");
-        cmd.push_back("4G");
-        
-        // VirtIO para mejor rendimiento
-        cmd.push_back("-vga");
-        cmd.push_back("virtio");
-        
-        // Configurar display según modo
-        if (useVNC) {
-            cmd.push_back("-display");
-            cmd.push_back("none");
-            cmd.push_back("-vnc");
-            cmd.push_back(":1");
-        } else {
-            cmd.push_back("-display");
-            cmd.push_back("gtk,full-screen=on");
+    // Un disco sin overlay sólo puede estar abierto en escritura por una
+    // instancia: QEMU bloquea la imagen y la segunda fallaría
+    bool diskInUse(const std::string& disk) const {
+        if (disk.empty() || vm.isEphemeral()) return false;
+        for (const auto& instance : assigned) {
+            if (instance->diskPath == disk) return true;
         }
-        
-        // UEFI Firmware con pflash - CORREGIDO
-        if (fs::exists(firmwarePath)) {
-            cmd.push_back("-drive");
-            cmd.push_back("if=pflash,format=raw,readonly=on,file=" + firmwarePath);
-            
-            // Crear VARS file si no existe
-            std::string varsPath = "./boot/firmware/OVMF_VARS.fd";
-            if (!fs::exists(varsPath)) {
-                printLog("INFO", "Creating OVMF VARS file...");
-                std::ofstream varsFile(varsPath, std::ios::binary);
-                std::vector<char> emptyVars(64 * 1024, 0);
-                varsFile.write(emptyVars.data(), emptyVars.size());
-                varsFile.close();
+        for (const auto& request : pending) {
+            if (request.disk == disk) return true;
+        }
+        return false;
+    }
+
+    std::unique_ptr<QEMUInstance> take(std::vector<std::unique_ptr<QEMUInstance>>& list, int id) {
+        for (auto it = list.begin(); it != list.end(); ++it) {
+            if ((*it)->id == id) {
+                auto instance = std::move(*it);
+                list.erase(it);
+                return instance;
             }
-            cmd.push_back("-drive");
-            cmd.push_back("if=pflash,format=raw,file=" + varsPath);
         }
-        
-        // Disco principal
-        if (fs::exists(diskPath)) {
-            cmd.push_back("-drive");
-            cmd.push_back("file=" + diskPath + ",format=qcow2,if=virtio");
+        return nullptr;
+    }
+
+    void retire(std::unique_ptr<QEMUInstance> instance) {
+        if (instance->process.pidfd >= 0) loop.remove(instance->process.pidfd);
+        vm.shutdownQEMU(*instance);
+        vm.removeInstanceFiles(*instance);
+        std::lock_guard<std::mutex> lock(mutex);
+        usedIds.erase(instance->id);
+    }
+
+    void onExit(int id) {
+        auto instance = take(ready, id);
+        if (!instance) instance = take(assigned, id);
+        if (!instance) return;
+        vm.printLog("INFO", "Pool machine " + std::to_string(id) + " exited");
+        retire(std::move(instance));
+        refill();
+    }
+
+    std::string acquire(const std::string& disk, const std::string& iso) {
+        if (diskInUse(disk)) {
+            return "error disk " + disk + " is already attached to another machine";
         }
-        
-        // ISO si existe
-        std::string isoFile = findISO();
-        if (!isoFile.empty()) {
-            cmd.push_back("-cdrom");
-            cmd.push_back(isoFile);
-            printLog("INFO", "ISO found: " + fs::path(isoFile).filename().string());
+        if (!ready.empty()) return handOut(disk, iso, Clock::now(), true);
+
+        // Pool vacío: la petición espera a un arranque en frío en otro hilo
+        // para no parar el bucle; cada una tiene el suyo en marcha
+        pending.push_back({control->deferReply(), disk, iso, Clock::now()});
+        int inFlight;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            inFlight = starting + static_cast<int>(launched.size());
         }
-        
-        // Audio ALSA
-        cmd.push_back("-audiodev");
-        cmd.push_back("alsa,id=audio0");
-        cmd.push_back("-device");
-        cmd.push_back("intel-hda");
-        cmd.push_back("-device");
-        cmd.push_back("hda-duplex,audiodev=audio0");
-        
-        // Red con VirtIO
-        cmd.push_back("-netdev");
-        cmd.push_back("user,id=net0");
-        cmd.push_back("-device");
-        cmd.push_back("virtio-net-pci,netdev=net0");
-        
-        // USB para mejor mouse/teclado
-        cmd.push_back("-device");
-        cmd.push_back("usb-ehci");
-        cmd.push_back("-device");
-        cmd.push_back("usb-tablet");
-        
-        // Sincronización de tiempo
-        cmd.push_back("-rtc");
-        cmd.push_back("base=localtime,clock=host");
-        
-        return cmd;
+        if (static_cast<int>(pending.size()) > inFlight) launchAsync();
+        return "";
     }
 
-    bool startWebsockify() {
-        if (!useVNC) return true;
+    // Entrega la primera instancia lista; start es cuando llegó la petición
+    std::string handOut(const std::string& disk, const std::string& iso, Clock::time_point start, bool hit) {
+        std::unique_ptr<QEMUInstance> instance = std::move(ready.front());
+        ready.erase(ready.begin());
+
+        std::string error;
+        if (!vm.handOut(*instance, disk, iso, error)) {
+            retire(std::move(instance));
+            refill();
+            return "error " + error;
+        }
         
-        printLog("INFO", "Starting websockify for noVNC...");
+        double latencyMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        (hit ? hits : misses)++;
+        totalLatencyMs += latencyMs;
+        maxLatencyMs = std::max(maxLatencyMs, latencyMs);
         
-        // Verificar que noVNC existe
-        if (!fs::exists(noVNCPath)) {
-            printLog("ERROR", "noVNC directory not found!");
-            return false;
+        std::ostringstream reply;
+        reply << "ok id=" << instance->id << " vnc=" << vm.vncAddress(*instance);
+        if (vm.vncAddress(*instance)[0] == ':') {
+            reply << " port=" << 5900 + instance->vncDisplay;
         }
-        
-        pid_t pid = fork();
-        if (pid == 0) {
-            // Proceso hijo - ejecutar websockify
-            std::string cmd = "websockify --web=" + noVNCPath + " 8080 localhost:5901";
-            execl("/bin/sh", "sh", "-c", cmd.c_str(), (char*)NULL);
-            exit(1);
-        } else if (pid > 0) {
-            websockifyPid = pid;
-            sleep(2); // Dar tiempo para que inicie
-            return true;
-        } else {
-            printLog("ERROR", "Failed to fork websockify process!");
-            return false;
+        reply << " qmp=" << instance->qmpSocketPath
+              << " hit=" << (hit ? 1 : 0) << " latency_ms=" << std::fixed << std::setprecision(1) << latencyMs;
+        vm.printLog("INFO", "Handed out pool machine " + std::to_string(instance->id) + " (" +
+                    (hit ? "hit" : "miss") + ", " + std::to_string(static_cast<int>(latencyMs)) + " ms)");
+        assigned.push_back(std::move(instance));
+        refill();
+        return reply.str();
+    }
+
+    std::string release(int id) {
+        auto instance = take(assigned, id);
+        if (!instance) return "error unknown machine " + std::to_string(id);
+        retire(std::move(instance));
+        refill();
+        return "ok";
+    }
+
+    std::string stats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t handouts = hits + misses;
+        std::ostringstream out;
+        out << "ok size=" << poolSize << " min=" << poolMin << " ready=" << ready.size() + launched.size()
+            << " starting=" << starting << " waiting=" << pending.size() << " assigned=" << assigned.size() << " hits=" << hits
+            << " misses=" << misses << " failures=" << failures << std::fixed << std::setprecision(1)
+            << " hit_rate=" << (handouts ? 100.0 * hits / handouts : 0.0) << "%"
+            << " latency_avg_ms=" << (handouts ? totalLatencyMs / handouts : 0.0)
+            << " latency_max_ms=" << maxLatencyMs;
+        return out.str();
+    }
+
+    std::string handleCommand(const std::string& line) {
+        std::istringstream words(line);
+        std::string command;
+        words >> command;
+        if (command == "acquire") {
+            std::string disk = vm.getDiskPath();
+            std::string iso = vm.findISO();
+            words >> disk >> iso;
+            return acquire(disk == "-" ? "" : disk, iso == "-" ? "" : iso);
+        } else if (command == "release") {
+            int id = -1;
+            words >> id;
+            return release(id);
+        } else if (command == "stats") {
+            return stats();
         }
+        return "error unknown command: " + command;
     }
 
-    bool startQEMU() {
-        printLog("INFO", "Starting QEMU virtual machine...");
-        
-        auto cmd = buildQEMUCommand();
+public:
+    MachinePool(ComputerVM& computer, int size, int minimum)
+        : vm(computer), poolSize(size), poolMin(minimum), wakeFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+          starting(0), launchFailures(0), hits(0), misses(0), failures(0), totalLatencyMs(0), maxLatencyMs(0),
+          control(nullptr) {}
+
+    ~MachinePool() {
+        if (wakeFd >= 0) close(wakeFd);
+    }
+
+    int run() {
+        vm.createDirectories();
+        vm.setHugePageGuests(poolSize);
+        if (!vm.planMachine() || !vm.planDiskIO()) return 1;
+        vm.settleDiskAIO();
+        int sigfd = openSignalfd();
+        if (sigfd < 0 || wakeFd < 0) {
+            vm.printLog("ERROR", "Failed to set up pool event loop!");
+            if (sigfd >= 0) close(sigfd);
+            return 1;
+        }
         
-        // DEBUG: Imprimir comando completo
-        printDebug("QEMU command:");
-        std::string fullCmd = "";
-        for (const auto& arg : cmd) {
-            fullCmd += arg + " ";
+        ControlServer server(loop);
+        if (!server.listen(vm.getControlSocketPath(), [this](const std::string& line) { return handleCommand(line); })) {
+            vm.printLog("ERROR", "Failed to open control socket " + vm.getControlSocketPath());
+            close(sigfd);
+            return 1;
         }
-        printDebug(fullCmd);
+        control = &server;
+        loop.add(sigfd, EPOLLIN, [this, sigfd](uint32_t) {
+            signalfd_siginfo info;
+            while (read(sigfd, &info, sizeof(info)) == sizeof(info)) {
+                if (info.ssi_signo != SIGCHLD) loop.stop();
+            }
+        });
+        loop.add(wakeFd, EPOLLIN, [this](uint32_t) { onLaunched(); });
         
-        // Convertir a array de char* para execv
-        std::vector<char*> args;
-        for (const auto& arg : cmd) {
-            args.push_back(const_cast<char*>(arg.c_str()));
-        }
-        args.push_back(nullptr);
-        
-        pid_t pid = fork();
-        if (pid == 0) {
-            // Proceso hijo - ejecutar QEMU
-            execvp(args[0], args.data());
-            exit(1);
-        } else if (pid > 0) {
-            qemuPid = pid;
-            sleep(3); // Dar más tiempo a QEMU para iniciar VNC
-            return true;
-        } else {
-            printLog("ERROR", "Failed to fork QEMU process!");
-            return false;
+        vm.printLog("INFO", "Starting pool of " + std::to_string(poolSize) + " machines, control socket " +
+                    vm.getControlSocketPath());
+        refill();
+        loop.run();
+        
+        std::cout << std::endl;
+        vm.printLog("INFO", "Shutting down pool... " + stats().substr(3));
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            launchesDone.wait(lock, [this]() { return starting == 0; });
+        }
+        onLaunched();
+        for (const auto& request : pending) {
+            server.respond(request.ticket, "error pool shutting down");
+        }
+        pending.clear();
+        control = nullptr;
+        while (!ready.empty()) {
+            retire(std::move(ready.back()));
+            ready.pop_back();
         }
+        while (!assigned.empty()) {
+            retire(std::move(assigned.back()));
+            assigned.pop_back();
+        }
+        close(sigfd);
+        return 0;
     }
+};
 
-    void cleanup() {
-        if (qemuPid != -1) {
-            kill(qemuPid, SIGTERM);
-            waitpid(qemuPid, nullptr, 0);
+// Latencia media por lanzamiento de fork()+exec frente a spawnProcess() con
+// distintos tamaños de memoria residente en el proceso padre
+static int benchmarkSpawn() {
+    const int iterations = 50;
+    std::cout << std::left << std::setw(10) << "RSS" << std::setw(18) << "fork+exec (us)"
+              << "posix_spawn (us)" << std::endl;
+
+    for (uint64_t rss : {0ULL, 256ULL << 20, 1ULL << 30, 4ULL << 30}) {
+        std::vector<char> ballast;
+        try {
+            ballast.assign(rss, 1);
+        } catch (const std::bad_alloc&) {
+            std::cout << std::setw(10) << formatSize(rss) << "allocation failed" << std::endl;
+            continue;
         }
-        if (websockifyPid != -1) {
-            kill(websockifyPid, SIGTERM);
-            waitpid(websockifyPid, nullptr, 0);
+
+        auto start = Clock::now();
+        for (int i = 0; i < iterations; i++) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                execl("/bin/true", "true", (char*)NULL);
+                _exit(127);
+            }
+            waitpid(pid, nullptr, 0);
         }
-    }
+        double forkUs = std::chrono::duration<double, std::micro>(Clock::now() - start).count() / iterations;
 
-    bool boot() {
-        printLog("LOG", "Booting Computer..");
-        printDebug("Checking components..");
-        
-        // Crear directorios necesarios
-        createDirectories();
-        
-        // Verificar componentes
-        checkFile(firmwarePath, "Firmware");
-        bool diskOk = checkFile(diskPath, "Disk") || createDefaultDisk();
-        std::string isoFile = findISO();
-        bool isoOk = !isoFile.empty();
-        
-        if (!isoOk) {
-            printDebug("ISO available.. No");
-        } else {
-            printDebug("ISO available.. Yes");
+        start = Clock::now();
+        for (int i = 0; i < iterations; i++) {
+            ChildProcess child;
+            std::string error;
+            if (!spawnProcess({"/bin/true"}, "", child, error)) {
+                std::cerr << "[ERROR] posix_spawn failed: " << error << std::endl;
+                return 1;
+            }
+            child.waitExit(-1);
         }
-        
-        if (!diskOk && !isoOk) {
-            printLog("ERROR", "No disk or ISO available!");
+        double spawnUs = std::chrono::duration<double, std::micro>(Clock::now() - start).count() / iterations;
+
+        std::cout << std::setw(10) << (rss ? formatSize(rss) : "0") << std::fixed << std::setprecision(1)
+                  << std::setw(18) << forkUs << spawnUs << std::endl;
+    }
+    return 0;
+}
+
+// Servidor VNC de pega para --bench-proxy: el primer byte elige el modo,
+// 'e' devuelve lo recibido y 's' envía datos sin parar hasta que cierren
+static void serveBenchVNC(int listenFd) {
+    while (true) {
+        int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) return;
+        std::thread([fd]() {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            std::vector<char> buf(256 * 1024, 'x');
+            char mode = 0;
+            if (read(fd, &mode, 1) == 1) {
+                while (true) {
+                    ssize_t n = mode == 'e' ? read(fd, buf.data(), buf.size()) : (ssize_t)buf.size();
+                    if (n <= 0 || send(fd, buf.data(), n, MSG_NOSIGNAL) != n) break;
+                }
+            }
+            close(fd);
+        }).detach();
+    }
+}
+
+// Cliente WebSocket bloqueante y mínimo para el benchmark
+struct BenchWebSocket {
+    int fd;
+    std::vector<unsigned char> pending;
+
+    BenchWebSocket() : fd(-1) {}
+    ~BenchWebSocket() {
+        if (fd >= 0) close(fd);
+    }
+
+    bool connect(int port, std::string& error) {
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(static_cast<uint16_t>(port));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            error = std::strerror(errno);
             return false;
         }
-        
-        printDebug("Checking Libraries..");
-        bool noVNCOk = checkFile(noVNCPath, "noVNC");
-        bool websockifyOk = (system("which websockify > /dev/null 2>&1") == 0);
-        printDebug(std::string("Websockify.. ") + (websockifyOk ? "Yes!" : "No"));
-        
-        if (useVNC && (!noVNCOk || !websockifyOk)) {
-            printLog("ERROR", "Required libraries not found for VNC mode!");
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        timeval timeout = {5, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        std::string request = "GET /websockify HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\n"
+                              "Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                              "Sec-WebSocket-Version: 13\r\nSec-WebSocket-Protocol: binary\r\n\r\n";
+        if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) != (ssize_t)request.size()) {
+            error = std::strerror(errno);
             return false;
         }
-        
-        printDebug("Starting Machine..");
-        
-        if (isoOk && fs::exists(diskPath)) {
-            printLog("INFO", "Booting from ISO with disk available!");
-        } else if (isoOk) {
-            printLog("INFO", "Booting from ISO only!");
-        } else {
-            printLog("INFO", "There's no ISO on rom/, Booting from disk!");
+        std::string response;
+        char buf[1024];
+        while (response.find("\r\n\r\n") == std::string::npos) {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0) {
+                error = "handshake failed";
+                return false;
+            }
+            response.append(buf, n);
         }
-        
-        // Iniciar QEMU
-        if (!startQEMU()) {
+        if (response.compare(0, 12, "HTTP/1.1 101") != 0 ||
+            httpHeader(response, "Sec-WebSocket-Accept") != "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=") {
+            error = "bad handshake: " + response.substr(0, response.find("\r\n"));
             return false;
         }
-        
-        // Iniciar websockify si usamos VNC
-        if (useVNC) {
-            if (!startWebsockify()) {
-                cleanup();
-                return false;
-            }
-            
-            printLog("INFO", "Port 8080 For Machine Opened! Go to http://localhost:8080/vnc.html?resize=remote&autoconnect=true");
+        size_t end = response.find("\r\n\r\n") + 4;
+        pending.assign(response.begin() + end, response.end());
+        return true;
+    }
+
+    bool sendBinary(const unsigned char* data, size_t size) {
+        unsigned char frame[14 + 256];
+        if (size > 256) return false;
+        size_t header = 2;
+        frame[0] = 0x82;
+        if (size < 126) {
+            frame[1] = 0x80 | static_cast<unsigned char>(size);
         } else {
-            printLog("INFO", "Machine started in full-screen mode!");
+            frame[1] = 0x80 | 126;
+            frame[2] = static_cast<unsigned char>(size >> 8);
+            frame[3] = static_cast<unsigned char>(size);
+            header = 4;
+        }
+        const unsigned char mask[4] = {0x12, 0x34, 0x56, 0x78};
+        std::memcpy(frame + header, mask, 4);
+        for (size_t i = 0; i < size; i++) frame[header + 4 + i] = data[i] ^ mask[i & 3];
+        size_t total = header + 4 + size;
+        return send(fd, frame, total, MSG_NOSIGNAL) == (ssize_t)total;
+    }
+
+    bool fill(size_t size) {
+        unsigned char buf[256 * 1024];
+        while (pending.size() < size) {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0) return false;
+            pending.insert(pending.end(), buf, buf + n);
         }
-        
         return true;
     }
 
-    void setVNCMode(bool enabled) {
-        useVNC = enabled;
+    // Carga de la siguiente trama de datos (las de control se ignoran)
+    bool receive(std::vector<unsigned char>& payload) {
+        while (true) {
+            if (!fill(2)) return false;
+            uint64_t length = pending[1] & 0x7f;
+            size_t header = 2;
+            if (length == 126) {
+                if (!fill(4)) return false;
+                length = (uint64_t(pending[2]) << 8) | pending[3];
+                header = 4;
+            } else if (length == 127) {
+                if (!fill(10)) return false;
+                length = 0;
+                for (int i = 0; i < 8; i++) length = (length << 8) | pending[2 + i];
+                header = 10;
+            }
+            if (!fill(header + length)) return false;
+            int opcode = pending[0] & 0x0f;
+            payload.assign(pending.begin() + header, pending.begin() + header + length);
+            pending.erase(pending.begin(), pending.begin() + header + length);
+            if (opcode == 8) return false;
+            if (opcode < 8) return true;
+        }
     }
 };
 
-void signalHandler(int /* sig */) {
-    std::cout << "\n[INFO] Shutting down gracefully..." << std::endl;
-    exit(0);
+// Latencia de ida y vuelta con tramas de 64 bytes y caudal servidor → cliente
+static bool benchmarkProxyPath(int port, double& p50, double& p99, double& mbps, std::string& error) {
+    std::vector<unsigned char> payload;
+    {
+        BenchWebSocket ws;
+        const unsigned char mode = 'e';
+        if (!ws.connect(port, error) || !ws.sendBinary(&mode, 1)) return false;
+        unsigned char message[64];
+        std::memset(message, 'p', sizeof(message));
+        std::vector<double> samples;
+        for (int i = 0; i < 2000; i++) {
+            auto start = Clock::now();
+            if (!ws.sendBinary(message, sizeof(message))) return false;
+            size_t received = 0;
+            while (received < sizeof(message)) {
+                if (!ws.receive(payload)) {
+                    error = "echo connection closed";
+                    return false;
+                }
+                received += payload.size();
+            }
+            samples.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+        }
+        std::sort(samples.begin(), samples.end());
+        p50 = samples[samples.size() / 2];
+        p99 = samples[samples.size() * 99 / 100];
+    }
+
+    BenchWebSocket ws;
+    const unsigned char mode = 's';
+    if (!ws.connect(port, error) || !ws.sendBinary(&mode, 1)) return false;
+    uint64_t bytes = 0;
+    auto start = Clock::now();
+    auto end = start + std::chrono::seconds(2);
+    while (Clock::now() < end) {
+        if (!ws.receive(payload)) {
+            error = "stream connection closed";
+            return false;
+        }
+        bytes += payload.size();
+    }
+    mbps = bytes / std::chrono::duration<double>(Clock::now() - start).count() / (1 << 20);
+    return true;
+}
+
+static int freeTCPPort() {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(addr);
+    int port = -1;
+    if (fd >= 0 && bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0 &&
+        getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &length) == 0) {
+        port = ntohs(addr.sin_port);
+    }
+    if (fd >= 0) close(fd);
+    return port;
+}
+
+// Compara el proxy integrado con websockify (si está en el PATH) sobre un
+// servidor VNC de pega en loopback
+static int benchmarkProxy() {
+    int vncFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(addr);
+    if (vncFd < 0 || bind(vncFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(vncFd, 16) != 0 ||
+        getsockname(vncFd, reinterpret_cast<sockaddr*>(&addr), &length) != 0) {
+        std::cerr << "[ERROR] Cannot listen for the fake VNC server: " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    int vncPort = ntohs(addr.sin_port);
+    std::thread(serveBenchVNC, vncFd).detach();
+
+    std::cout << std::left << std::setw(14) << "proxy" << std::setw(12) << "p50 (us)" << std::setw(12) << "p99 (us)"
+              << std::setw(20) << "throughput (MB/s)" << "copied/frame (B)" << std::endl;
+    auto report = [](const std::string& name, bool ok, double p50, double p99, double mbps, const std::string& copied,
+                     const std::string& error) {
+        std::cout << std::setw(14) << name;
+        if (!ok) {
+            std::cout << "skipped (" << error << ")" << std::endl;
+            return;
+        }
+        std::cout << std::fixed << std::setprecision(1) << std::setw(12) << p50 << std::setw(12) << p99
+                  << std::setw(20) << mbps << copied << std::endl;
+    };
+
+    double p50 = 0, p99 = 0, mbps = 0;
+    std::string error;
+    for (bool splice : {true, false}) {
+        WebSocketProxy proxy;
+        int port = freeTCPPort();
+        WebSocketProxy::Options options = {port, "/nonexistent", "", "127.0.0.1", vncPort};
+        options.splice = splice;
+        options.adaptive = false; // el servidor de pega no habla RFB
+        bool ok = proxy.start(options, error) && benchmarkProxyPath(port, p50, p99, mbps, error);
+        std::ostringstream copied;
+        copied << std::fixed << std::setprecision(1) << proxy.copiedPerFrame();
+        report(splice ? "native-splice" : "native-copy", ok, p50, p99, mbps, copied.str(), error);
+        if (!ok) return 1;
+    }
+
+    if (findExecutable("websockify").empty()) {
+        report("websockify", false, 0, 0, 0, "", "not found in PATH");
+        return 0;
+    }
+    int port = freeTCPPort();
+    ChildProcess websockify;
+    error.clear();
+    bool ok = spawnProcess({"websockify", std::to_string(port), "127.0.0.1:" + std::to_string(vncPort)}, "/dev/null",
+                           websockify, error);
+    if (ok) {
+        // Otro proceso puede escuchar en ese puerto: sólo cuenta si websockify sigue vivo
+        auto deadline = Clock::now() + std::chrono::seconds(5);
+        bool ready = false;
+        while (!ready && websockify.alive() && Clock::now() < deadline) {
+            ready = probeTCPPort("127.0.0.1", port, deadline);
+            if (!ready) usleep(20000);
+        }
+        if (ready && websockify.alive()) {
+            ok = benchmarkProxyPath(port, p50, p99, mbps, error);
+        } else {
+            ok = false;
+            error = websockify.alive() ? "not listening after 5 s" : "exited during startup";
+        }
+    }
+    report("websockify", ok, p50, p99, mbps, "n/a", error);
+    websockify.sendSignal(SIGTERM);
+    if (!websockify.waitExit(2000)) {
+        websockify.sendSignal(SIGKILL);
+        websockify.waitExit(-1);
+    }
+    return 0;
 }
 
 int main(int argc, char* argv[]) {
-    // Configurar manejo de señales
-    signal(SIGINT, signalHandler);
-    signal(SIGTERM, signalHandler);
+    if (argc > 3 && std::string(argv[1]) == "--exec-child") {
+        return execChild(argv);
+    }
+    
+    // Configurar manejo de señales: se bloquean y se atienden con signalfd en
+    // ComputerVM::boot() y ComputerVM::run()
+    sigset_t mask = supervisedSignals();
+    sigprocmask(SIG_BLOCK, &mask, nullptr);
+    signal(SIGPIPE, SIG_IGN);
     
     ComputerVM vm;
     
+    if (argc > 1 && std::string(argv[1]) == "--bench-spawn") {
+        return benchmarkSpawn();
+    }
+    if (argc > 1 && std::string(argv[1]) == "--bench-proxy") {
+        return benchmarkProxy();
+    }
+    
     // Procesar argumentos
     bool noVNC = false;
+    int poolSize = 0;
+    int poolMin = -1;
+    std::string checkDiskPath;
     for (int i = 1; i < argc; i++) {
-        if (std::string(argv[i]) == "--no-vnc") {
+        std::string arg = argv[i];
+        if (arg == "--no-vnc") {
             noVNC = true;
-            break;
+        } else if (arg == "--resume") {
+            vm.setResume(true);
+        } else if (arg == "--trace" && i + 1 < argc) {
+            vm.setTracePath(argv[++i]);
+        } else if (arg == "--cpus" && i + 1 < argc) {
+            std::string policy = argv[++i];
+            bool percent = !policy.empty() && policy.back() == '%';
+            int cpus;
+            if (!parseInt(percent ? policy.substr(0, policy.size() - 1) : policy, 1, percent ? 100 : 1024, cpus)) {
+                std::cerr << "[ERROR] --cpus expects a vCPU count or a host percentage such as 50%" << std::endl;
+                return 1;
+            }
+            vm.setCPUPolicy(policy);
+        } else if (arg == "--memory" && i + 1 < argc) {
+            std::string policy = argv[++i];
+            bool percent = !policy.empty() && policy.back() == '%';
+            int share;
+            if (percent ? !parseInt(policy.substr(0, policy.size() - 1), 1, 100, share) : parseSize(policy) == 0) {
+                std::cerr << "[ERROR] --memory expects a size such as 8G or a host percentage such as 50%" << std::endl;
+                return 1;
+            }
+            vm.setMemoryPolicy(policy);
+        } else if (arg == "--profile" && i + 1 < argc) {
+            vm.setMachineProfile(argv[++i]);
+        } else if (arg == "--pin" && i + 1 < argc) {
+            vm.setPinPolicy(argv[++i]);
+        } else if (arg == "--emulator-cpus" && i + 1 < argc) {
+            vm.setEmulatorCPUs(argv[++i]);
+        } else if (arg == "--numa" && i + 1 < argc) {
+            vm.setNUMAPolicy(argv[++i]);
+        } else if (arg == "--hugepages" && i + 1 < argc) {
+            vm.setHugePagePolicy(argv[++i]);
+        } else if (arg == "--prealloc" && i + 1 < argc) {
+            std::string prealloc = argv[++i];
+            if (prealloc != "on" && prealloc != "off") {
+                std::cerr << "[ERROR] --prealloc expects on or off" << std::endl;
+                return 1;
+            }
+            vm.setMemoryPrealloc(prealloc == "on");
+        } else if (arg == "--iothreads" && i + 1 < argc) {
+            int count;
+            if (!parseInt(argv[++i], 1, 64, count)) {
+                std::cerr << "[ERROR] --iothreads expects a number of threads between 1 and 64" << std::endl;
+                return 1;
+            }
+            vm.setIOThreads(count);
+        } else if (arg == "--disk-cache" && i + 1 < argc) {
+            vm.setDiskCache(argv[++i]);
+        } else if (arg == "--vnc-transport" && i + 1 < argc) {
+            std::string transport = argv[++i];
+            if (transport != "unix" && transport != "tcp") {
+                std::cerr << "[ERROR] --vnc-transport expects unix or tcp" << std::endl;
+                return 1;
+            }
+            vm.setVNCTransport(transport);
+        } else if (arg == "--accel" && i + 1 < argc) {
+            vm.setAccelerator(argv[++i]);
+        } else if (arg == "--ephemeral" && i + 1 < argc) {
+            std::string mode = argv[++i];
+            if (mode != "discard" && mode != "commit") {
+                std::cerr << "[ERROR] --ephemeral expects discard or commit" << std::endl;
+                return 1;
+            }
+            vm.setEphemeralMode(mode);
+        } else if (arg == "--control" && i + 1 < argc) {
+            std::string command;
+            while (++i < argc) {
+                command += (command.empty() ? "" : " ") + std::string(argv[i]);
+            }
+            return sendControlCommand(vm.getControlSocketPath(), command);
+        } else if (arg == "--pool" && i + 1 < argc) {
+            if (!parseInt(argv[++i], 1, 64, poolSize)) {
+                std::cerr << "[ERROR] --pool expects a number of machines between 1 and 64" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--pool-min" && i + 1 < argc) {
+            if (!parseInt(argv[++i], 0, 64, poolMin)) {
+                std::cerr << "[ERROR] --pool-min expects a number of machines between 0 and 64" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--qemu-timeout" && i + 1 < argc) {
+            int timeoutMs;
+            if (!parseInt(argv[++i], 1, 3600000, timeoutMs)) {
+                std::cerr << "[ERROR] --qemu-timeout expects milliseconds between 1 and 3600000" << std::endl;
+                return 1;
+            }
+            vm.setQEMUTimeout(timeoutMs);
+        } else if (arg == "--proxy-relay" && i + 1 < argc) {
+            std::string relay = argv[++i];
+            if (relay != "splice" && relay != "copy") {
+                std::cerr << "[ERROR] --proxy-relay expects splice or copy" << std::endl;
+                return 1;
+            }
+            vm.setProxySplice(relay == "splice");
+        } else if (arg == "--vnc-adaptive" && i + 1 < argc) {
+            std::string adaptive = argv[++i];
+            if (adaptive != "on" && adaptive != "off") {
+                std::cerr << "[ERROR] --vnc-adaptive expects on or off" << std::endl;
+                return 1;
+            }
+            vm.setProxyAdaptive(adaptive == "on");
+        } else if (arg == "--check-disk" && i + 1 < argc) {
+            checkDiskPath = argv[++i];
+        } else if (arg == "--vnc-broadcast") {
+            vm.setProxyBroadcast(true);
+        } else if (arg == "--proxy-timeout" && i + 1 < argc) {
+            int timeoutMs;
+            if (!parseInt(argv[++i], 1, 3600000, timeoutMs)) {
+                std::cerr << "[ERROR] --proxy-timeout expects milliseconds between 1 and 3600000" << std::endl;
+                return 1;
+            }
+            vm.setProxyTimeout(timeoutMs);
+        } else if (arg == "--shutdown-timeout" && i + 1 < argc) {
+            int timeoutMs;
+            if (!parseInt(argv[++i], 1, 3600000, timeoutMs)) {
+                std::cerr << "[ERROR] --shutdown-timeout expects milliseconds between 1 and 3600000" << std::endl;
+                return 1;
+            }
+            vm.setShutdownTimeout(timeoutMs);
+        } else if (arg == "--disk-size" && i + 1 < argc) {
+            uint64_t bytes = parseSize(argv[++i]);
+            if (bytes == 0) {
+                std::cerr << "[ERROR] --disk-size expects a size such as 20G or 512M" << std::endl;
+                return 1;
+            }
+            vm.setDiskSize(bytes);
+        } else if (arg == "--disk-cluster-size" && i + 1 < argc) {
+            uint64_t bytes = parseSize(argv[++i]);
+            if (bytes < 512 || bytes > (2ULL << 20) || (bytes & (bytes - 1)) != 0) {
+                std::cerr << "[ERROR] --disk-cluster-size expects a power of two between 512 and 2M" << std::endl;
+                return 1;
+            }
+            vm.setDiskClusterSize(bytes);
+        } else if (arg == "--disk-profile" && i + 1 < argc) {
+            vm.setDiskProfile(argv[++i]);
+        } else if (arg == "--disk-prealloc" && i + 1 < argc) {
+            std::string mode = argv[++i];
+            if (mode != "off" && mode != "metadata" && mode != "falloc") {
+                std::cerr << "[ERROR] --disk-prealloc expects off, metadata or falloc" << std::endl;
+                return 1;
+            }
+            vm.setDiskPreallocation(mode);
+        } else if (arg == "--disk-lazy-refcounts" && i + 1 < argc) {
+            std::string lazy = argv[++i];
+            if (lazy != "on" && lazy != "off") {
+                std::cerr << "[ERROR] --disk-lazy-refcounts expects on or off" << std::endl;
+                return 1;
+            }
+            vm.setDiskLazyRefcounts(lazy == "on");
+        } else if (arg == "--disk-extended-l2" && i + 1 < argc) {
+            std::string extended = argv[++i];
+            if (extended != "on" && extended != "off") {
+                std::cerr << "[ERROR] --disk-extended-l2 expects on or off" << std::endl;
+                return 1;
+            }
+            vm.setDiskExtendedL2(extended == "on");
         }
     }
     
     vm.setVNCMode(!noVNC);
     
+    if (!checkDiskPath.empty()) {
+        return vm.checkDiskImage(checkDiskPath);
+    }
+    if (poolMin > poolSize && poolSize > 0) {
+        std::cerr << "[ERROR] --pool-min cannot be larger than --pool" << std::endl;
+        return 1;
+    }
+    if (poolSize > 0) {
+        MachinePool pool(vm, poolSize, poolMin < 0 ? poolSize : poolMin);
+        return pool.run();
+    }
+    
     if (vm.boot()) {
-        // Mantener el programa corriendo
-        while (true) {
-            sleep(1);
-        }
+        // Mantener el programa corriendo hasta que termine la máquina
+        return vm.run();
+    } else if (vm.wasInterrupted()) {
+        return 0;
     } else {
         std::cerr << "[ERROR] Failed to boot virtual machine!" << std::endl;
         return 1;